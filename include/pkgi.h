@@ -27,6 +27,7 @@
 #define PKGI_UNUSED(x) (void)(x)
 
 #define PKGI_APP_FOLDER "/dev_hdd0/game/NP00PKGI3/USRDIR"
+#define PKGI_GAME_FOLDER "/dev_hdd0/game"
 #define PKGI_RAP_FOLDER "/dev_hdd0/exdata"
 #define PKGI_TMP_FOLDER "/dev_hdd0/tmp/pkgi"
 #define PKGI_QUEUE_FOLDER "/dev_hdd0/vsh/task"
@@ -64,6 +65,10 @@ int pkgi_cancel_button(void);
 
 void pkgi_start(void);
 int pkgi_update(pkgi_input* input);
+// a frame is either drawn between pkgi_start_frame() and pkgi_swap(), or skipped with pkgi_idle_frame()
+// which leaves the previous one on screen
+void pkgi_start_frame(void);
+void pkgi_idle_frame(void);
 void pkgi_swap(void);
 void pkgi_end(void);
 
@@ -81,10 +86,22 @@ int pkgi_install(const char* titleid);
 uint32_t pkgi_time_msec();
 
 typedef void pkgi_thread_entry(void);
-void pkgi_start_thread(const char* name, pkgi_thread_entry* start);
+int pkgi_start_thread(const char* name, pkgi_thread_entry* start);
 void pkgi_thread_exit(void);
 void pkgi_sleep(uint32_t msec);
 
+typedef uint32_t pkgi_sem;
+int pkgi_sem_create(pkgi_sem* sem, uint32_t count, uint32_t max);
+void pkgi_sem_wait(pkgi_sem sem);
+void pkgi_sem_post(pkgi_sem sem);
+void pkgi_sem_destroy(pkgi_sem sem);
+
+typedef uint32_t pkgi_mutex;
+int pkgi_mutex_create(pkgi_mutex* mutex, const char* name);
+void pkgi_mutex_lock(pkgi_mutex mutex);
+void pkgi_mutex_unlock(pkgi_mutex mutex);
+void pkgi_mutex_destroy(pkgi_mutex mutex);
+
 int pkgi_load(const char* name, void* data, uint32_t max);
 int pkgi_save(const char* name, const void* data, uint32_t size);
 
@@ -96,16 +113,30 @@ int pkgi_dialog_unlock(void);
 
 void pkgi_dialog_input_text(const char* title, const char* text);
 int pkgi_dialog_input_update(void);
+int pkgi_dialog_input_active(void);
 void pkgi_dialog_input_get_text(char* text, uint32_t size);
 
 int pkgi_check_free_space(uint64_t http_length);
 
 typedef struct pkgi_http pkgi_http;
 
+// called once with the response Content-Length (-1 if unknown) before the first
+// body chunk is written, return 0 to abort the transfer
+typedef int pkgi_http_length_func(int64_t length);
+
 int pkgi_validate_url(const char* url);
 pkgi_http* pkgi_http_get(const char* url, const char* content, uint64_t offset);
+// requests only size bytes starting at offset
+pkgi_http* pkgi_http_get_range(const char* url, uint64_t offset, uint64_t size);
+// issues a body-less request, only for callers that never read the response body
 int pkgi_http_response_length(pkgi_http* http, int64_t* length);
-int pkgi_http_read(pkgi_http* http, void* write_func, void* xferinfo_func);
+int pkgi_http_read(pkgi_http* http, void* write_func, pkgi_http_length_func* length_func, void* xferinfo_func);
+// limits in bytes per second, 0 is unlimited; the global limit applies from start_hour
+// to end_hour, or all day if both are equal
+void pkgi_http_set_rate_limit(uint32_t global_rate, uint32_t transfer_rate, int start_hour, int end_hour);
+// reason and retry hint for the last failed pkgi_http_read
+const char* pkgi_http_error(pkgi_http* http);
+int pkgi_http_can_retry(pkgi_http* http);
 void pkgi_http_close(pkgi_http* http);
 
 int pkgi_mkdirs(const char* path);
@@ -116,13 +147,17 @@ int64_t pkgi_get_size(const char* path);
 void* pkgi_create(const char* path);
 // open existing file in read mode, fails if file does not exist
 void* pkgi_open(const char* path);
-// open file for writing, next write will append data to end of it
-void* pkgi_append(const char* path);
+// open existing file for writing at explicit offsets, fails if file does not exist
+void* pkgi_open_rw(const char* path);
 
 void pkgi_close(void* f);
 
 int pkgi_read(void* f, void* buffer, uint32_t size);
+int pkgi_read_at(void* f, uint64_t offset, void* buffer, uint32_t size);
 int pkgi_write(void* f, const void* buffer, uint32_t size);
+int pkgi_write_at(void* f, uint64_t offset, const void* buffer, uint32_t size);
+// flushes written data to disk
+int pkgi_sync(void* f);
 
 // UI stuff
 typedef void* pkgi_texture;
@@ -144,6 +179,20 @@ void pkgi_draw_texture(pkgi_texture texture, int x, int y);
 void pkgi_draw_texture_z(pkgi_texture texture, int x, int y, int z, float scale);
 void pkgi_free_texture(pkgi_texture texture);
 
+// icon thumbnails live in cells of one shared texture, in the ICON0.PNG aspect ratio
+#define PKGI_THUMB_WIDTH 40
+#define PKGI_THUMB_HEIGHT 22
+#define PKGI_THUMB_COLUMNS 8
+#define PKGI_THUMB_SLOTS (PKGI_THUMB_COLUMNS * PKGI_THUMB_COLUMNS)
+
+// decodes a png scaled down to one thumbnail cell of ARGB pixels, can run on any thread
+int pkgi_load_png_thumb(const char* filename, uint32_t* pixels);
+void pkgi_thumb_upload(uint32_t slot, const uint32_t* pixels);
+// thumbnails drawn between begin and end are sent as a single batch of quads
+void pkgi_thumb_begin(void);
+void pkgi_draw_thumb(uint32_t slot, int x, int y, int z, int w, int h);
+void pkgi_thumb_end(void);
+
 void pkgi_clip_set(int x, int y, int w, int h);
 void pkgi_clip_remove(void);
 void pkgi_draw_rect(int x, int y, int w, int h, uint32_t color);
@@ -62,6 +62,11 @@ typedef enum {
     ContentTool
 } ContentType;
 
+typedef enum {
+    DigestSha256,   // whole pkg, from the db checksum column
+    DigestSha1,     // pkg without its 32 byte footer, from the update xml sha1sum
+} DigestType;
+
 typedef struct {
     DbPresence presence;
     const char* content;
@@ -70,7 +75,10 @@ typedef struct {
     const char* description;
     const uint8_t* rap;
     const char* url;
+    const char* mirrors;    // mirror_count extra urls, each one NUL terminated
+    uint8_t mirror_count;
     const uint8_t* digest;
+    DigestType digest_type;
     int64_t size;
 } DbItem;
 
@@ -92,6 +100,17 @@ typedef struct Config {
     uint8_t music;
     uint8_t allow_refresh;
     char language[3];
+    uint32_t write_buffer_kb;
+    uint32_t checkpoint_mb;
+    uint32_t retry_count;
+    uint32_t rate_limit_kb;
+    uint32_t transfer_limit_kb;
+    uint8_t rate_limit_start;
+    uint8_t rate_limit_end;
+    uint8_t verify_chunks;
+    uint8_t chunk_manifest;
+    uint8_t icons;
+    uint32_t update_cache_hours;
 } Config;
 
 
@@ -100,11 +119,25 @@ int pkgi_db_update(const char* update_url, uint32_t update_len, char* error, uin
 void pkgi_db_get_update_status(uint32_t* updated, uint32_t* total);
 int pkgi_db_load_xml_updates(const char* content_id, const char* name);
 
+#define PKGI_SCAN_CONNECTIONS 4
+#define PKGI_UPDATE_CACHE_HOURS 24
+
+// reports scanned titles, return nonzero to stop the scan
+typedef int pkgi_db_scan_func(uint32_t done, uint32_t total);
+
+// fetches the update xmls of all titles in PKGI_GAME_FOLDER, returns the number of updates added
+int pkgi_db_scan_updates(pkgi_db_scan_func* progress);
+
 void pkgi_db_configure(const char* search, const Config* config);
 
 uint32_t pkgi_db_count(void);
 uint32_t pkgi_db_total(void);
 DbItem* pkgi_db_get(uint32_t index);
+// searches all loaded items, ignoring the current filter
+DbItem* pkgi_db_find(const char* content);
+
+// converts hex string in place, returns NULL if it is too short
+uint8_t* pkgi_hexbytes(const char* digest, uint32_t length);
 
 GameRegion pkgi_get_region(const char* content);
 ContentType pkgi_get_content_type(uint32_t content);
@@ -22,6 +22,8 @@ int pkgi_dialog_is_cancelled(void);
 void pkgi_dialog_allow_close(int allow);
 void pkgi_dialog_message(const char* title, const char* text);
 void pkgi_dialog_error(const char* text);
+// copies the text of the error dialog being shown, returns 0 if none is
+int pkgi_dialog_get_error(char* text, uint32_t size);
 void pkgi_dialog_details(DbItem* item, const char* type);
 void pkgi_dialog_ok_cancel(const char* title, const char* text, pkgi_dialog_callback_t callback);
 
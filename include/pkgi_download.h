@@ -4,9 +4,28 @@
 #include "pkgi_db.h"
 
 #define PKGI_RAP_SIZE 16
+#define PKGI_WRITE_BUFFER_KB 2048
+#define PKGI_CHECKPOINT_MB 64
+#define PKGI_RETRY_COUNT 5
 
+void pkgi_download_init(void);
+void pkgi_download_configure(const Config* config);
 int pkgi_download(const DbItem* item, const int background_dl);
 int pkgi_download_icon(const char* content);
 char * pkgi_http_download_buffer(const char* url, uint32_t* buf_size);
+// downloads into a caller owned buffer, which is grown (and may move) as needed
+int pkgi_http_download_reuse(const char* url, char** buffer, uint32_t* capacity, uint32_t* buf_size);
+
+typedef struct {
+    const char* url;
+    const char* etag;   // sent as If-None-Match when not NULL
+} pkgi_http_batch_item;
+
+// called as each item of a batch finishes, data is NULL if it failed and empty on 304 (not modified)
+// status is the http response code, etag the response ETag or ""; return nonzero to stop the batch
+typedef int pkgi_http_batch_func(uint32_t index, int status, const char* data, uint32_t size, const char* etag, void* user);
+
+// fetches all items over up to parallel connections, done runs on the calling thread
+int pkgi_http_download_batch(const pkgi_http_batch_item* items, uint32_t count, uint32_t parallel, pkgi_http_batch_func* done, void* user);
 
 int rap2rif(const uint8_t* rap, const char* content_id, const char *exdata_path);
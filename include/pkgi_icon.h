@@ -0,0 +1,31 @@
+#pragma once
+
+#include "pkgi.h"
+
+// decoded icons kept in memory, least recently used are freed first
+#define PKGI_ICON_CACHE_SIZE 32
+
+// items around the cursor whose icons are fetched ahead
+#define PKGI_ICON_PREFETCH 4
+
+// icon files kept in PKGI_TMP_FOLDER, oldest are deleted first
+#define PKGI_ICON_DISK_MB 16
+
+// starts the worker thread that fetches icons in the background
+void pkgi_icon_init(void);
+void pkgi_icon_end(void);
+
+// queues an icon fetch, the latest request is served first
+void pkgi_icon_request(const char* content);
+
+// copies thumbnails decoded by the worker into the atlas, once per frame before drawing
+void pkgi_icon_update(void);
+
+// returns 1 when pkgi_icon_update() has thumbnails to copy
+int pkgi_icon_pending(void);
+
+// returns the atlas slot of the icon thumbnail, or -1 while it is being decoded (main thread only)
+int pkgi_icon_thumb(const char* content);
+
+// returns the icon texture, or NULL while it is being fetched (main thread only)
+pkgi_texture pkgi_icon_get(const char* content);
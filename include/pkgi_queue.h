@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PKGI_QUEUE_SIZE 64
+
+// the queue is kept in queue.txt in the config folder, one content id per line
+void pkgi_queue_init(void);
+
+int pkgi_queue_add(const char* content);
+void pkgi_queue_remove(const char* content);
+int pkgi_queue_contains(const char* content);
+uint32_t pkgi_queue_count(void);
+
+// sizes are cached until the queue changes, call this when the db may have changed them
+void pkgi_queue_refresh(void);
+
+// total size of queued items except the given one, items of unknown size are skipped
+uint64_t pkgi_queue_size(const char* skip);
+
+// copies the content id at the given position of the queue, returns 0 past its end
+int pkgi_queue_get(uint32_t index, char* content, uint32_t size);
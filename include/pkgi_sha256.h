@@ -4,4 +4,5 @@
 #include <polarssl/sha1.h>
 #include <polarssl/sha256.h>
 
+#define SHA1_DIGEST_SIZE 20
 #define SHA256_DIGEST_SIZE 32
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// exponentially weighted moving average of a transfer rate
+typedef struct {
+    uint64_t last_bytes;
+    uint32_t last_time;
+    float rate;  // bytes per second, 0 until the first sample
+} pkgi_speed;
+
+// starts a new estimate, bytes is the current transfer position
+void pkgi_speed_reset(pkgi_speed* speed, uint64_t bytes);
+
+// feeds the current transfer position, samples closer than 250 msec are merged
+void pkgi_speed_update(pkgi_speed* speed, uint64_t bytes);
+
+uint32_t pkgi_speed_rate(const pkgi_speed* speed);
+
+// seconds left for remaining bytes at the current rate, 0 if the rate is not known yet
+uint32_t pkgi_speed_eta(const pkgi_speed* speed, uint64_t remaining);
@@ -15,6 +15,7 @@
 
 #define PKGI_UTF8_INSTALLED "\xe2\x97\x8f" // ● (U+25CF)
 #define PKGI_UTF8_PARTIAL   "\xe2\x97\x8b" // ○ (U+25CB)
+#define PKGI_UTF8_QUEUED    "\xc2\xbb" // » (U+00BB)
 
 #define PKGI_UTF8_B  "B"
 #define PKGI_UTF8_KB "Kb"
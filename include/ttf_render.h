@@ -34,5 +34,9 @@ extern float Z_ttf;
 
 int display_ttf_string(int posx, int posy, const char *string, u32 color, u32 bkcolor, int sw, int sh);
 
+// same width as display_ttf_string() with color 0, cached by string contents, size and window mode
+
+int width_ttf_string(const char *string, int sw, int sh);
+
 
 #endif
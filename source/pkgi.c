@@ -4,6 +4,8 @@
 #include "pkgi_config.h"
 #include "pkgi_dialog.h"
 #include "pkgi_download.h"
+#include "pkgi_queue.h"
+#include "pkgi_icon.h"
 #include "pkgi_utils.h"
 #include "pkgi_style.h"
 #include "pkgi_sha256.h"
@@ -14,6 +16,10 @@
 
 #define content_filter(c)   (c ? 1 << (7 + c) : DbFilterAllContent)
 
+// while nothing changes the screen is only redrawn this often, for the temperatures and free space
+#define IDLE_REDRAW_MSEC    1000
+#define FRAME_STATS_MSEC    10000
+
 typedef enum  {
     StateError,
     StateRefreshing,
@@ -26,9 +32,12 @@ static State state;
 
 static uint32_t first_item;
 static uint32_t selected_item;
+static uint32_t prefetch_item = UINT32_MAX;
 
 static int search_active;
 
+static DbItem* download_item;
+
 static char refresh_url[MAX_CONTENT_TYPES][256];
 
 static Config config;
@@ -76,6 +85,43 @@ static void pkgi_refresh_thread(void)
     pkgi_thread_exit();
 }
 
+static int scan_progress(uint32_t done, uint32_t total)
+{
+    char text[256];
+    pkgi_snprintf(text, sizeof(text), "%s %u / %u", _("Installed titles"), done, total);
+    pkgi_dialog_update_progress(text, NULL, NULL, total ? (float)done / total : 1.f);
+
+    return pkgi_dialog_is_cancelled();
+}
+
+static void pkgi_scan_thread(void)
+{
+    LOG("starting update scan");
+    pkgi_lock_process();
+
+    int updates = pkgi_db_scan_updates(&scan_progress);
+
+    pkgi_unlock_process();
+
+    if (updates < 0)
+    {
+        pkgi_dialog_error(_("Failed to download the update list"));
+    }
+    else
+    {
+        char text[256];
+        pkgi_snprintf(text, sizeof(text), "%d %s", updates, _("update(s) loaded"));
+        pkgi_dialog_message(_("Scan updates"), text);
+
+        // the new items are shown in one go by the main loop
+        first_item = 0;
+        selected_item = 0;
+        state = StateUpdateDone;
+    }
+
+    pkgi_thread_exit();
+}
+
 static int install(const char* content)
 {
     LOG("installing...");
@@ -100,9 +146,57 @@ static int install(const char* content)
     return 1;
 }
 
+static int is_failed(DbItem* const* failed, uint32_t count, const char* content)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (pkgi_stricmp(failed[i]->content, content) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// items of a different db (or updates before a scan) and failed ones stay queued but are skipped
+static DbItem* next_queued_item(DbItem* const* failed, uint32_t failed_count)
+{
+    char content[64];
+
+    for (uint32_t index = 0; pkgi_queue_get(index, content, sizeof(content)); index++)
+    {
+        DbItem* item = pkgi_db_find(content);
+        if (item && !is_failed(failed, failed_count, content))
+        {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t count_missing_items(void)
+{
+    char content[64];
+    uint32_t missing = 0;
+
+    for (uint32_t index = 0; pkgi_queue_get(index, content, sizeof(content)); index++)
+    {
+        if (!pkgi_db_find(content))
+        {
+            LOG("queued item %s not found", content);
+            missing++;
+        }
+    }
+    return missing;
+}
+
 static void pkgi_download_thread(void)
 {
-    DbItem* item = pkgi_db_get(selected_item);
+    DbItem* item = download_item;
+    uint32_t downloaded = 0;
+    uint32_t failed = 0;
+    DbItem* failed_items[PKGI_QUEUE_SIZE + 1];
+    char first_error[256];
 
     LOG("download thread start");
 
@@ -110,27 +204,83 @@ static void pkgi_download_thread(void)
     pkgi_sleep(300);
 
     pkgi_lock_process();
-    if (pkgi_download(item, config.dl_mode_background))
+
+    // the selected item goes first, then the queue runs back-to-back
+    while (item)
     {
-        if (!config.dl_mode_background)
+        int ok = pkgi_download(item, config.dl_mode_background) && (config.dl_mode_background || install(item->content));
+        item->presence = PresenceUnknown;
+
+        if (pkgi_dialog_is_cancelled())
         {
-            install(item->content);
-            pkgi_dialog_message(item->name, _("Successfully downloaded"));
+            // a cancelled item stays queued, so the queue can be resumed later
+            break;
+        }
+
+        if (ok)
+        {
+            downloaded++;
+            LOG("download completed!");
+            pkgi_queue_remove(item->content);
         }
         else
         {
-            pkgi_dialog_message(item->name, _("Task successfully queued (reboot to start)"));
+            // a failed item keeps its resume data and its place in the queue, the reason is shown at the end
+            char error[256];
+            if (!pkgi_dialog_get_error(error, sizeof(error)))
+            {
+                error[0] = 0;
+            }
+            if (failed == 0)
+            {
+                pkgi_snprintf(first_error, sizeof(first_error), "%s: %s", item->name, error);
+            }
+            LOG("download of %s failed: %s", item->content, error);
+            failed_items[failed++] = item;
+        }
+
+        if (failed > PKGI_QUEUE_SIZE)
+        {
+            break;
+        }
+
+        item = next_queued_item(failed_items, failed);
+        if (item)
+        {
+            LOG("starting queued download %s", item->content);
+            pkgi_dialog_start_progress(_("Downloading..."), _("Preparing..."), 0);
         }
-        LOG("download completed!");
     }
+
     pkgi_unlock_process();
 
+    uint32_t missing = pkgi_dialog_is_cancelled() ? 0 : count_missing_items();
+
+    if (downloaded + failed > 1 || missing)
+    {
+        char text[256];
+        int len = pkgi_snprintf(text, sizeof(text), _("%u items downloaded, %u failed"), downloaded, failed);
+        if (missing)
+        {
+            len += pkgi_snprintf(text + len, sizeof(text) - len, "\n");
+            len += pkgi_snprintf(text + len, sizeof(text) - len, _("%u queued items are not in this list"), missing);
+        }
+        if (failed)
+        {
+            pkgi_snprintf(text + len, sizeof(text) - len, "\n%s", first_error);
+        }
+        pkgi_dialog_message(_("Download queue"), text);
+    }
+    else if (downloaded)
+    {
+        pkgi_dialog_message(download_item->name, config.dl_mode_background ? _("Task successfully queued (reboot to start)") : _("Successfully downloaded"));
+    }
+
     if (pkgi_dialog_is_cancelled())
     {
         pkgi_dialog_close();
     }
 
-    item->presence = PresenceUnknown;
     state = StateMain;
 
     pkgi_thread_exit();
@@ -246,13 +396,32 @@ static void cb_dialog_download(int res)
     DbItem* item = pkgi_db_get(selected_item);
 
     item->presence = PresenceMissing;
+    download_item = item;
     pkgi_dialog_start_progress(_("Downloading..."), _("Preparing..."), 0);
     pkgi_start_thread("download_thread", &pkgi_download_thread);
 }
 
+// the selected item is requested last, so the icon thread serves it first
+static void prefetch_icons(uint32_t db_count)
+{
+    uint32_t first = selected_item > PKGI_ICON_PREFETCH ? selected_item - PKGI_ICON_PREFETCH : 0;
+    uint32_t last = min32(selected_item + PKGI_ICON_PREFETCH, db_count - 1);
+
+    for (uint32_t i = last; i > selected_item; i--)
+    {
+        pkgi_icon_request(pkgi_db_get(i)->content);
+    }
+    for (uint32_t i = first; i <= selected_item; i++)
+    {
+        pkgi_icon_request(pkgi_db_get(i)->content);
+    }
+    prefetch_item = selected_item;
+}
+
 static void pkgi_do_main(pkgi_input* input)
 {
-    int col_titleid = PKGI_MAIN_HMARGIN;
+    int thumb_width = config.icons ? font_height * PKGI_THUMB_WIDTH / PKGI_THUMB_HEIGHT : 0;
+    int col_titleid = PKGI_MAIN_HMARGIN + (config.icons ? thumb_width + PKGI_MAIN_COLUMN_PADDING : 0);
     int col_region = col_titleid + pkgi_text_width("PCSE00000") + PKGI_MAIN_COLUMN_PADDING;
     int col_installed = col_region + pkgi_text_width("USA") + PKGI_MAIN_COLUMN_PADDING;
     int col_name = col_installed + pkgi_text_width(PKGI_UTF8_INSTALLED) + PKGI_MAIN_COLUMN_PADDING;
@@ -378,6 +547,20 @@ static void pkgi_do_main(pkgi_input* input)
         }
     }
     
+    if (db_count && selected_item != prefetch_item)
+    {
+        prefetch_icons(db_count);
+    }
+
+    // thumbnails are collected while the rows are drawn and sent in one batch afterwards
+    int thumb_slot[PKGI_THUMB_SLOTS];
+    int thumb_y[PKGI_THUMB_SLOTS];
+    uint32_t thumb_count = 0;
+    if (config.icons)
+    {
+        pkgi_icon_update();
+    }
+
     int y = font_height*3/2 + PKGI_MAIN_HLINE_EXTRA + PKGI_MAIN_VMARGIN;
     int line_height = font_height + PKGI_MAIN_ROW_PADDING;
     for (uint32_t i = first_item; i < db_count; i++)
@@ -403,6 +586,16 @@ static void pkgi_do_main(pkgi_input* input)
         pkgi_friendly_size(size_str, sizeof(size_str), item->size);
         int sizew = pkgi_text_width(size_str);
 
+        if (config.icons && line_height >= font_height && thumb_count < PKGI_THUMB_SLOTS)
+        {
+            int slot = pkgi_icon_thumb(item->content);
+            if (slot >= 0)
+            {
+                thumb_slot[thumb_count] = slot;
+                thumb_y[thumb_count++] = y;
+            }
+        }
+
         pkgi_clip_set(0, y, VITA_WIDTH, line_height);
         pkgi_draw_text(col_titleid, y, color, titleid);
         const char* region;
@@ -415,7 +608,11 @@ static void pkgi_do_main(pkgi_input* input)
         default: region = "---"; break;
         }
         pkgi_draw_text(col_region, y, color, region);
-        if (item->presence == PresenceIncomplete)
+        if (pkgi_queue_contains(item->content))
+        {
+            pkgi_draw_text(col_installed, y, color, PKGI_UTF8_QUEUED);
+        }
+        else if (item->presence == PresenceIncomplete)
         {
             pkgi_draw_text(col_installed, y, color, PKGI_UTF8_PARTIAL);
         }
@@ -441,6 +638,16 @@ static void pkgi_do_main(pkgi_input* input)
         }
     }
 
+    if (thumb_count)
+    {
+        pkgi_thumb_begin();
+        for (uint32_t i = 0; i < thumb_count; i++)
+        {
+            pkgi_draw_thumb(thumb_slot[i], PKGI_MAIN_HMARGIN, thumb_y[i], PKGI_FONT_Z, thumb_width, font_height);
+        }
+        pkgi_thumb_end();
+    }
+
     if (db_count == 0)
     {
         const char* text = _("No items!");
@@ -482,6 +689,7 @@ static void pkgi_do_main(pkgi_input* input)
         else if (item->presence == PresenceIncomplete || (item->presence == PresenceMissing))
         {
             LOG("[%.9s] %s - starting to install", item->content + 7, item->name);
+            download_item = item;
             pkgi_dialog_start_progress(_("Downloading..."), _("Preparing..."), 0);
             pkgi_start_thread("download_thread", &pkgi_download_thread);
         }
@@ -494,13 +702,33 @@ static void pkgi_do_main(pkgi_input* input)
 
         pkgi_menu_start(search_active, &config);
     }
+    else if (input && (input->pressed & PKGI_BUTTON_START) && db_count)
+    {
+        input->pressed &= ~PKGI_BUTTON_START;
+
+        DbItem* item = pkgi_db_get(selected_item);
+
+        if (pkgi_queue_contains(item->content))
+        {
+            LOG("[%.9s] %s - removed from queue", item->content + 7, item->name);
+            pkgi_queue_remove(item->content);
+        }
+        else if (!pkgi_queue_add(item->content))
+        {
+            pkgi_dialog_error(_("Download queue is full"));
+        }
+        else
+        {
+            LOG("[%.9s] %s - added to queue", item->content + 7, item->name);
+        }
+    }
     else if (input && (input->active & PKGI_BUTTON_S) && db_count)
     {
         input->pressed &= ~PKGI_BUTTON_S;
 
         DbItem* item = pkgi_db_get(selected_item);
 
-        pkgi_download_icon(item->content);
+        pkgi_icon_request(item->content);
         pkgi_dialog_details(item, content_type_str(item->type));
     }
 }
@@ -571,6 +799,13 @@ static void pkgi_do_tail(void)
     {
         pkgi_snprintf(text, sizeof(text), "%s: %u (%u)", _("Count"), count, total);
     }
+
+    uint32_t queued = pkgi_queue_count();
+    if (queued)
+    {
+        int len = pkgi_strlen(text);
+        pkgi_snprintf(text + len, sizeof(text) - len, "  %s: %u", _("Queue"), queued);
+    }
     pkgi_draw_text(PKGI_MAIN_HMARGIN, bottom_y, PKGI_COLOR_TEXT_TAIL, text);
 
     char size[64];
@@ -701,6 +936,10 @@ int main(int argc, const char* argv[])
     pkgi_start();
 
     pkgi_load_config(&config, (char*) &refresh_url, sizeof(refresh_url[0]));
+    pkgi_download_init();
+    pkgi_download_configure(&config);
+    pkgi_queue_init();
+    pkgi_icon_init();
     if (config.music)
     {
         pkgi_start_music();
@@ -723,9 +962,40 @@ int main(int argc, const char* argv[])
         pkgi_start_thread("update_thread", &pkgi_update_check_thread);
     }
 
+    uint32_t redraw_time = 0;
+    uint32_t stats_time = pkgi_time_msec();
+    uint32_t frames_drawn = 0;
+    uint32_t frames_idle = 0;
+    uint32_t frames_msec = 0;
+    int was_active = 1;
+
     pkgi_input input = {0, 0, 0, 0};
     while (pkgi_update(&input) && (state != StateTerminate))
     {
+        uint32_t frame_start = pkgi_time_msec();
+
+        if (frame_start - stats_time >= FRAME_STATS_MSEC)
+        {
+            LOG("frames: %u drawn, %u idle, %u msec drawing", frames_drawn, frames_idle, frames_msec);
+            frames_drawn = frames_idle = frames_msec = 0;
+            stats_time = frame_start;
+        }
+
+        // anything animating or waiting on input is drawn every frame, and once more after it stops
+        int active = input.down || state != StateMain || pkgi_dialog_is_open() || pkgi_menu_is_open() ||
+            pkgi_dialog_input_active() || (config.icons && pkgi_icon_pending());
+
+        if (!active && !was_active && frame_start - redraw_time < IDLE_REDRAW_MSEC)
+        {
+            pkgi_idle_frame();
+            frames_idle++;
+            continue;
+        }
+
+        was_active = active;
+        redraw_time = frame_start;
+
+        pkgi_start_frame();
         pkgi_draw_background(background);
 
         if (state == StateUpdateDone)
@@ -829,20 +1099,30 @@ int main(int argc, const char* argv[])
                 {
                     pkgi_menu_get(&config);
                     pkgi_save_config(&config, (char*) &refresh_url, sizeof(refresh_url[0]));
+                    pkgi_download_configure(&config);
                 }
                 else if (mres == MenuResultRefresh)
                 {
                     state = StateRefreshing;
                     pkgi_start_thread("refresh_thread", &pkgi_refresh_thread);
                 }
+                else if (mres == MenuResultScanUpdates)
+                {
+                    pkgi_dialog_start_progress(_("Scanning updates"), _("Preparing..."), 0);
+                    pkgi_start_thread("scan_thread", &pkgi_scan_thread);
+                }
             }
         }
 
+        frames_msec += pkgi_time_msec() - frame_start;
+        frames_drawn++;
+
         pkgi_swap();
     }
 
     LOG("finished");
     mini18n_close();
+    pkgi_icon_end();
     pkgi_free_texture(background);
     pkgi_end();
 	return 0;
@@ -1,4 +1,5 @@
 #include "pkgi_config.h"
+#include "pkgi_download.h"
 #include "pkgi.h"
 
 static char* skipnonws(char* text, char* end)
@@ -106,6 +107,25 @@ static DbSortOrder parse_filter(char* value, uint32_t filter)
     return result;
 }
 
+// "start-end" in hours, end may be before start to cover midnight
+static void parse_hours(char* value, uint8_t* start, uint8_t* end)
+{
+    char* sep = pkgi_strstr(value, "-");
+    if (!sep)
+    {
+        return;
+    }
+    *sep = 0;
+
+    int64_t first = pkgi_strtoll(value);
+    int64_t last = pkgi_strtoll(sep + 1);
+    if (first >= 0 && first < 24 && last >= 0 && last < 24)
+    {
+        *start = (uint8_t)first;
+        *end = (uint8_t)last;
+    }
+}
+
 void pkgi_load_config(Config* config, char* refresh_url, uint32_t refresh_len)
 {
     refresh_url[0] = 0;
@@ -117,6 +137,17 @@ void pkgi_load_config(Config* config, char* refresh_url, uint32_t refresh_len)
     config->music = 1;
     config->content = 0;
     config->allow_refresh = 0;
+    config->write_buffer_kb = PKGI_WRITE_BUFFER_KB;
+    config->checkpoint_mb = PKGI_CHECKPOINT_MB;
+    config->retry_count = PKGI_RETRY_COUNT;
+    config->rate_limit_kb = 0;
+    config->transfer_limit_kb = 0;
+    config->rate_limit_start = 0;
+    config->rate_limit_end = 0;
+    config->verify_chunks = 1;
+    config->chunk_manifest = 0;
+    config->icons = 0;
+    config->update_cache_hours = PKGI_UPDATE_CACHE_HOURS;
     pkgi_strncpy(config->language, 3, pkgi_get_user_language());
 
     char data[4096];
@@ -200,6 +231,46 @@ void pkgi_load_config(Config* config, char* refresh_url, uint32_t refresh_len)
             {
                 pkgi_strncpy(config->language, 2, value);
             }
+            else if (pkgi_stricmp(key, "write_buffer_kb") == 0)
+            {
+                config->write_buffer_kb = (uint32_t)pkgi_strtoll(value);
+            }
+            else if (pkgi_stricmp(key, "checkpoint_mb") == 0)
+            {
+                config->checkpoint_mb = (uint32_t)pkgi_strtoll(value);
+            }
+            else if (pkgi_stricmp(key, "retry_count") == 0)
+            {
+                config->retry_count = (uint32_t)pkgi_strtoll(value);
+            }
+            else if (pkgi_stricmp(key, "rate_limit_kb") == 0)
+            {
+                config->rate_limit_kb = (uint32_t)pkgi_strtoll(value);
+            }
+            else if (pkgi_stricmp(key, "transfer_limit_kb") == 0)
+            {
+                config->transfer_limit_kb = (uint32_t)pkgi_strtoll(value);
+            }
+            else if (pkgi_stricmp(key, "rate_limit_hours") == 0)
+            {
+                parse_hours(value, &config->rate_limit_start, &config->rate_limit_end);
+            }
+            else if (pkgi_stricmp(key, "no_chunk_verify") == 0)
+            {
+                config->verify_chunks = 0;
+            }
+            else if (pkgi_stricmp(key, "chunk_manifest") == 0)
+            {
+                config->chunk_manifest = 1;
+            }
+            else if (pkgi_stricmp(key, "icons") == 0)
+            {
+                config->icons = 1;
+            }
+            else if (pkgi_stricmp(key, "update_cache_hours") == 0)
+            {
+                config->update_cache_hours = (uint32_t)pkgi_strtoll(value);
+            }
         }
     }
     else
@@ -311,6 +382,56 @@ void pkgi_save_config(const Config* config, const char* update_url, uint32_t upd
         len += pkgi_snprintf(data + len, sizeof(data) - len, "no_music 1\n");
     }
 
+    if (config->write_buffer_kb != PKGI_WRITE_BUFFER_KB)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "write_buffer_kb %u\n", config->write_buffer_kb);
+    }
+
+    if (config->checkpoint_mb != PKGI_CHECKPOINT_MB)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "checkpoint_mb %u\n", config->checkpoint_mb);
+    }
+
+    if (config->retry_count != PKGI_RETRY_COUNT)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "retry_count %u\n", config->retry_count);
+    }
+
+    if (config->rate_limit_kb)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "rate_limit_kb %u\n", config->rate_limit_kb);
+    }
+
+    if (config->transfer_limit_kb)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "transfer_limit_kb %u\n", config->transfer_limit_kb);
+    }
+
+    if (config->rate_limit_start != config->rate_limit_end)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "rate_limit_hours %u-%u\n", config->rate_limit_start, config->rate_limit_end);
+    }
+
+    if (!config->verify_chunks)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "no_chunk_verify 1\n");
+    }
+
+    if (config->chunk_manifest)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "chunk_manifest 1\n");
+    }
+
+    if (config->update_cache_hours != PKGI_UPDATE_CACHE_HOURS)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "update_cache_hours %u\n", config->update_cache_hours);
+    }
+
+    if (config->icons)
+    {
+        len += pkgi_snprintf(data + len, sizeof(data) - len, "icons 1\n");
+    }
+
     char path[256];
     pkgi_snprintf(path, sizeof(path), "%s/config.txt", pkgi_get_config_folder());
 
@@ -7,11 +7,33 @@
 
 #include <stddef.h>
 #include <mini18n.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <libxml/xmlreader.h>
+#include <dirent.h>
+#include <time.h>
 
 #define MAX_DB_SIZE (32*1024*1024)
 #define MAX_DB_ITEMS 0x20000
+#define MAX_SCAN_TITLES 1024
+
+#define MAX_TITLE_UPDATES 32
+
+#define UPDATE_XML_URL "https://a0.ww.np.dl.playstation.net/tpl/np/%.9s/%.9s-ver.xml"
+#define UPDATE_CACHE_FOLDER PKGI_TMP_FOLDER "/updates"
+
+typedef struct {
+    char version[8];
+    char sha1[44];
+    int64_t size;
+    char url[256];
+} UpdateInfo;
+
+typedef struct {
+    uint64_t time;
+    char etag[64];
+    uint32_t count;
+    UpdateInfo updates[MAX_TITLE_UPDATES];
+} UpdateCache;
+
 #define MAX_DB_COLUMNS 32
 
 #define EXTDB_ID_LENGTH 110
@@ -20,6 +42,7 @@
 static char* db_data = NULL;
 static uint32_t db_total;
 static uint32_t db_size;
+static int db_too_large;
 
 static DbItem db[MAX_DB_ITEMS];
 static uint32_t db_count;
@@ -27,6 +50,13 @@ static uint32_t db_count;
 static DbItem* db_item[MAX_DB_ITEMS];
 static uint32_t db_item_count;
 
+// items past db_loaded come from update xmls
+static uint32_t db_loaded;
+
+// update lists of a title are cached for update_ttl seconds
+static uint64_t update_ttl = PKGI_UPDATE_CACHE_HOURS * 3600;
+static char cache_data[MAX_TITLE_UPDATES * 512];
+
 typedef enum {
     ColumnContentId,
     ColumnContentType,
@@ -107,7 +137,7 @@ static uint8_t hexvalue(char ch)
     return 0;
 }
 
-static uint8_t* pkgi_hexbytes(const char* digest, uint32_t length)
+uint8_t* pkgi_hexbytes(const char* digest, uint32_t length)
 {
     uint8_t* result = (uint8_t*)digest;
 
@@ -126,6 +156,41 @@ static uint8_t* pkgi_hexbytes(const char* digest, uint32_t length)
     return result;
 }
 
+// the url column can list mirrors after the main url, separated by spaces
+static void split_mirrors(DbItem* item, char* url)
+{
+    item->mirrors = NULL;
+    item->mirror_count = 0;
+
+    while (*url && *url != ' ')
+    {
+        url++;
+    }
+
+    while (*url)
+    {
+        while (*url == ' ')
+        {
+            *url++ = 0;
+        }
+        if (*url == 0)
+        {
+            break;
+        }
+
+        if (!item->mirrors)
+        {
+            item->mirrors = url;
+        }
+        item->mirror_count++;
+
+        while (*url && *url != ' ')
+        {
+            url++;
+        }
+    }
+}
+
 static char* generate_contentid(void)
 {
     char* cid = (char*)pkgi_malloc(37);
@@ -137,16 +202,36 @@ static size_t write_update_data(void *buffer, size_t size, size_t nmemb, void *s
 {
     size_t realsize = size * nmemb;
 
+    // chunked responses have no length to check upfront
+    if (db_size + realsize > MAX_DB_SIZE - 1)
+    {
+        db_too_large = 1;
+        return 0;
+    }
+
     pkgi_memcpy(db_data + db_size, buffer, realsize);
     db_size += realsize;
 
     return (realsize);
 }
 
+static int check_update_length(int64_t length)
+{
+    if (length > (int64_t)(MAX_DB_SIZE - 1))
+    {
+        db_too_large = 1;
+        return 0;
+    }
+
+    db_total = length > 0 ? (uint32_t)length : 0;
+    return 1;
+}
+
 int update_database(const char* update_url, const char* path, char* error, uint32_t error_size)
 {
     db_total = 0;
     db_size = 0;
+    db_too_large = 0;
     LOG("downloading update from %s", update_url);
 
     pkgi_http* http = pkgi_http_get(update_url, NULL, 0);
@@ -155,48 +240,37 @@ int update_database(const char* update_url, const char* path, char* error, uint3
         pkgi_snprintf(error, error_size, "%s\n%s", _("failed to download list from"), update_url);
         return 0;
     }
-    else
+
+    error[0] = 0;
+    if (!pkgi_http_read(http, &write_update_data, &check_update_length, NULL))
     {
-        int64_t length;
-        if (!pkgi_http_response_length(http, &length))
+        if (db_too_large)
+        {
+            pkgi_snprintf(error, error_size, _("list is too large... check for newer pkgi version!"));
+        }
+        else if (db_size == 0)
         {
             pkgi_snprintf(error, error_size, "%s\n%s", _("failed to download list from"), update_url);
         }
         else
         {
-            if (length > (int64_t)(MAX_DB_SIZE - 1))
-            {
-                pkgi_snprintf(error, error_size, _("list is too large... check for newer pkgi version!"));
-            }
-            else if (length != 0)
-            {
-                db_total = (uint32_t)length;
-                error[0] = 0;
-
-                if (!pkgi_http_read(http, &write_update_data, NULL))
-                {
-                    pkgi_snprintf(error, error_size, "%s", _("HTTP download error"));
-                    db_size = 0;
-                }
-            }
-
-            if (error[0] == 0 && db_size == 0)
-            {
-                pkgi_snprintf(error, error_size, _("list is empty... check the DB server"));
-            }
+            pkgi_snprintf(error, error_size, "%s", _("HTTP download error"));
         }
+        db_size = 0;
+    }
+    else if (db_size == 0)
+    {
+        pkgi_snprintf(error, error_size, _("list is empty... check the DB server"));
+    }
 
-        pkgi_http_close(http);
+    pkgi_http_close(http);
 
-        if (db_size == 0)
-        {
-            return 0;
-        }
-        else
-        {
-            pkgi_save(path, db_data, db_size);
-        }
+    if (db_size == 0)
+    {
+        return 0;
     }
+
+    pkgi_save(path, db_data, db_size);
     return 1;
 }
 
@@ -315,6 +389,7 @@ static int load_database(uint8_t db_id)
             db[db_count].description = dbf.data[ColumnDescription].data;
             db[db_count].rap = pkgi_hexbytes(dbf.data[ColumnRap].data, PKGI_RAP_SIZE);
             db[db_count].url = dbf.data[ColumnUrl].data;
+            split_mirrors(&db[db_count], (char*)dbf.data[ColumnUrl].data);
             db[db_count].size = pkgi_strtoll(dbf.data[ColumnSize].data);
             db[db_count].digest = pkgi_hexbytes(dbf.data[ColumnChecksum].data, SHA256_DIGEST_SIZE);
             db_item[db_count] = db + db_count;
@@ -381,6 +456,9 @@ int pkgi_db_reload(char* error, uint32_t error_size)
         return 0;
     }
 
+    // set up once, update lists are parsed later on whichever thread asks for them
+    xmlInitParser();
+
     for (int i = 0; i < MAX_CONTENT_TYPES; i++)
     {
         pkgi_snprintf(path, sizeof(path), "%s/pkgi%s.txt", pkgi_get_config_folder(), pkgi_content_tag(i));
@@ -392,6 +470,7 @@ int pkgi_db_reload(char* error, uint32_t error_size)
     }
 
     LOG("finished db update, %u total items", db_count);
+    db_loaded = db_count;
 
     if (db_count == 0)
     {
@@ -493,6 +572,8 @@ static void heapify(uint32_t n, uint32_t index, DbSort sort, DbSortOrder order,
 
 void pkgi_db_configure(const char* search, const Config* config)
 {
+    update_ttl = config->update_cache_hours * 3600ULL;
+
     uint32_t search_count;
     if (!search)
     {
@@ -584,6 +665,18 @@ DbItem* pkgi_db_get(uint32_t index)
     return index < db_item_count ? db_item[index] : NULL;
 }
 
+DbItem* pkgi_db_find(const char* content)
+{
+    for (uint32_t i = 0; i < db_count; i++)
+    {
+        if (pkgi_stricmp(db[i].content, content) == 0)
+        {
+            return &db[i];
+        }
+    }
+    return NULL;
+}
+
 GameRegion pkgi_get_region(const char* content)
 {
     switch (content[0])
@@ -614,91 +707,419 @@ ContentType pkgi_get_content_type(uint32_t content)
     return ContentUnknown;
 }
 
-int pkgi_db_load_xml_updates(const char* content_id, const char* name)
+// a bulk scan only knows the title id, the content id is taken from the pkg file name instead
+static const char* update_content_id(const char* content_id, const char* url, char* buffer, uint32_t size)
 {
-    xmlDoc *doc = NULL;
-    xmlNode *root_element = NULL;
-    xmlNode *cur_node = NULL;
-    char *value;
-    char updUrl[256];
-    uint32_t size, updates = 0;
+    if (content_id)
+    {
+        return content_id;
+    }
 
-    pkgi_snprintf(updUrl, sizeof(updUrl), "https://a0.ww.np.dl.playstation.net/tpl/np/%.9s/%.9s-ver.xml", content_id + 7, content_id + 7);
-    LOG("Loading update xml (%s)...", updUrl);
+    const char* name = url;
+    for (const char* ptr = url; *ptr; ptr++)
+    {
+        if (*ptr == '/')
+        {
+            name = ptr + 1;
+        }
+    }
+    pkgi_snprintf(buffer, size, "%.36s", name);
+    return buffer;
+}
 
-    char * buffer = pkgi_http_download_buffer(updUrl, &size);
+static int find_update(const char* content)
+{
+    for (uint32_t i = db_loaded; i < db_count; i++)
+    {
+        if (pkgi_stricmp(db[i].content, content) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    if (!buffer)
-        return (-1);
+static int add_update(const char* content_id, const char* name, const UpdateInfo* info)
+{
+    char content[64];
 
-    /*parse the file and get the DOM */
-    doc = xmlParseMemory(buffer, size);
+    if (db_count == MAX_DB_ITEMS || db_size + 4096 >= MAX_DB_SIZE)
+    {
+        return 0;
+    }
 
-    if (!doc)
+    // append the version to content-id
+    pkgi_snprintf(db_data + db_size, 1024, "%s_%s", update_content_id(content_id, info->url, content, sizeof(content)), info->version);
+    if (find_update(db_data + db_size))
     {
-        LOG("XML: could not parse file %s", updUrl);
-        free(buffer);
+        LOG("Update: %s already loaded", db_data + db_size);
         return 0;
     }
 
-    /*Get the root element node */
-    root_element = xmlDocGetRootElement(doc);
-    cur_node = root_element->children;
+    memset(&db[db_count], 0, sizeof(DbItem));
+    db[db_count].type = ContentUpdate;
+
+    db[db_count].content = db_data + db_size;
+    db_size += (pkgi_strlen(db[db_count].content) + 1);
+
+    uint32_t size = pkgi_strlen(info->version) + 1;
+    pkgi_memcpy(db_data + db_size, info->version, size);
+    db[db_count].description = db_data + db_size;
+    db_size += size;
+
+    pkgi_snprintf(db_data + db_size, 1024, "%s (%s)", name, info->version);
+    db[db_count].name = db_data + db_size;
+    db_size += (pkgi_strlen(db[db_count].name) + 1);
+
+    size = pkgi_strlen(info->url) + 1;
+    pkgi_memcpy(db_data + db_size, info->url, size);
+    db[db_count].url = db_data + db_size;
+    db[db_count].mirrors = NULL;
+    db[db_count].mirror_count = 0;
+    db_size += size;
+
+    db[db_count].size = info->size;
+
+    if (info->sha1[0])
+    {
+        size = pkgi_strlen(info->sha1) + 1;
+        pkgi_memcpy(db_data + db_size, info->sha1, size);
+        db[db_count].digest = pkgi_hexbytes(db_data + db_size, SHA1_DIGEST_SIZE);
+        db[db_count].digest_type = DigestSha1;
+        db_size += size;
+    }
+
+    LOG("Update: '%s' [%d] %s", db[db_count].name, db[db_count].size, db[db_count].url);
+
+    db_item[db_count] = db + db_count;
+    db_count++;
+    return 1;
+}
 
-    if (xmlStrcasecmp(cur_node->name, BAD_CAST "tag") == 0)
-        cur_node = cur_node->children;
+// attribute values are copied straight out of the reader, nothing is allocated per package
+static void read_package(xmlTextReaderPtr reader, UpdateInfo* info)
+{
+    memset(info, 0, sizeof(UpdateInfo));
 
-    for (; cur_node; cur_node = cur_node->next)
+    while (xmlTextReaderMoveToNextAttribute(reader) == 1)
     {
-        if (cur_node->type != XML_ELEMENT_NODE)
+        const char* name = (const char*) xmlTextReaderConstName(reader);
+        const char* value = (const char*) xmlTextReaderConstValue(reader);
+        if (!name || !value)
             continue;
 
-        if ((xmlStrcasecmp(cur_node->name, BAD_CAST "package") == 0) && (db_count < MAX_DB_ITEMS))
+        if (pkgi_stricmp(name, "version") == 0)
+            pkgi_strncpy(info->version, sizeof(info->version), value);
+        else if (pkgi_stricmp(name, "url") == 0)
+            pkgi_strncpy(info->url, sizeof(info->url), value);
+        else if (pkgi_stricmp(name, "size") == 0)
+            info->size = pkgi_strtoll(value);
+        else if (pkgi_stricmp(name, "sha1sum") == 0)
+            pkgi_strncpy(info->sha1, sizeof(info->sha1), value);
+    }
+    xmlTextReaderMoveToElement(reader);
+}
+
+static int parse_xml_updates(const char* buffer, uint32_t size, UpdateInfo* infos)
+{
+    int count = 0;
+    int ret;
+
+    xmlTextReaderPtr reader = xmlReaderForMemory(buffer, size, NULL, NULL, XML_PARSE_NONET | XML_PARSE_NOBLANKS);
+    if (!reader)
+    {
+        return -1;
+    }
+
+    while ((ret = xmlTextReaderRead(reader)) == 1 && count < MAX_TITLE_UPDATES)
+    {
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+            continue;
+
+        const char* name = (const char*) xmlTextReaderConstLocalName(reader);
+        if (name && pkgi_stricmp(name, "package") == 0)
         {
-            memset(&db[db_count], 0, sizeof(DbItem));
-            db[db_count].type = ContentUpdate;
+            UpdateInfo* info = &infos[count];
+            read_package(reader, info);
 
-            value = (char*) xmlGetProp(cur_node, BAD_CAST "version");
-            size = pkgi_strlen(value) + 1;
-            pkgi_memcpy(db_data + db_size, value, size);
-            db[db_count].description = db_data + db_size;
-            db_size += size;
+            if (info->version[0] && info->url[0])
+                count++;
+        }
+    }
+    xmlFreeTextReader(reader);
 
-            // append the version to content-id
-            pkgi_snprintf(db_data + db_size, 1024, "%s_%s", content_id, value);
-            db[db_count].content = db_data + db_size;
-            db_size += (pkgi_strlen(db[db_count].content) + 1);
+    return ret < 0 ? -1 : count;
+}
 
-            pkgi_snprintf(db_data + db_size, 1024, "%s (%s)", name, value);
-            db[db_count].name = db_data + db_size;
-            db_size += (pkgi_strlen(db[db_count].name) + 1);
+static void get_cache_path(char* path, uint32_t size, const char* titleid)
+{
+    pkgi_snprintf(path, size, "%s/%s.txt", UPDATE_CACHE_FOLDER, titleid);
+}
 
-            value = (char*) xmlGetProp(cur_node, BAD_CAST "url");
-            size = pkgi_strlen(value) + 1;
-            pkgi_memcpy(db_data + db_size, value, size);
-            db[db_count].url = db_data + db_size;
-            db_size += size;
+// first line is "<fetch time> <etag>", then one "<version> <size> <sha1> <url>" line per update
+static int load_update_cache(const char* titleid, UpdateCache* cache)
+{
+    char path[256];
+    char* token[5];
 
-            value = (char*) xmlGetProp(cur_node, BAD_CAST "size");
-            db[db_count].size = pkgi_strtoll(value);
+    // the cache is shared between titles, nothing of the previous one may survive a miss
+    cache->time = 0;
+    cache->etag[0] = 0;
+    cache->count = 0;
 
-//            value = (char*) xmlGetProp(cur_node, BAD_CAST "ps3_system_ver");
-//            value = (char*) xmlGetProp(cur_node, BAD_CAST "sha1sum");
-//            LOG("SHA1 (%s)", value);
-//            db[db_count].digest = pkgi_hexbytes(value, SHA1_DIGEST_SIZE);
+    get_cache_path(path, sizeof(path), titleid);
+    int loaded = pkgi_load(path, cache_data, sizeof(cache_data) - 1);
+    if (loaded <= 0)
+    {
+        return 0;
+    }
+    cache_data[loaded] = 0;
 
-            LOG("Update: '%s' [%d] %s", db[db_count].name, db[db_count].size, db[db_count].url);
+    char* ptr = cache_data;
+    for (int line = 0; *ptr && cache->count < MAX_TITLE_UPDATES; line++)
+    {
+        int tokens = 0;
+        while (*ptr && *ptr != '\n' && tokens < 5)
+        {
+            while (*ptr == ' ')
+                *ptr++ = 0;
+            if (*ptr && *ptr != '\n')
+                token[tokens++] = ptr;
+            while (*ptr && *ptr != ' ' && *ptr != '\n')
+                ptr++;
+        }
+        while (*ptr && *ptr != '\n')
+            ptr++;
+        if (*ptr == '\n')
+            *ptr++ = 0;
 
-            db_item[db_count] = db + db_count;
-            db_count++;
-            updates++;
+        if (line == 0)
+        {
+            if (tokens < 2)
+                return 0;
+            cache->time = pkgi_strtoll(token[0]);
+            pkgi_strncpy(cache->etag, sizeof(cache->etag), pkgi_stricmp(token[1], "-") == 0 ? "" : token[1]);
+        }
+        else if (tokens == 4)
+        {
+            UpdateInfo* info = &cache->updates[cache->count++];
+            pkgi_strncpy(info->version, sizeof(info->version), token[0]);
+            info->size = pkgi_strtoll(token[1]);
+            pkgi_strncpy(info->sha1, sizeof(info->sha1), pkgi_stricmp(token[2], "-") == 0 ? "" : token[2]);
+            pkgi_strncpy(info->url, sizeof(info->url), token[3]);
+        }
+    }
+
+    return 1;
+}
+
+static void save_update_cache(const char* titleid, const UpdateCache* cache)
+{
+    char path[256];
+    int len = 0;
+
+    len += pkgi_snprintf(cache_data + len, sizeof(cache_data) - len, "%llu %s\n", (uint64_t)cache->time, cache->etag[0] ? cache->etag : "-");
+    for (uint32_t i = 0; i < cache->count; i++)
+    {
+        const UpdateInfo* info = &cache->updates[i];
+        len += pkgi_snprintf(cache_data + len, sizeof(cache_data) - len, "%s %lld %s %s\n",
+            info->version, info->size, info->sha1[0] ? info->sha1 : "-", info->url);
+    }
+
+    get_cache_path(path, sizeof(path), titleid);
+    if (!pkgi_save(path, cache_data, len))
+    {
+        LOG("cannot save %s", path);
+    }
+}
+
+static int is_title_id(const char* name)
+{
+    if (pkgi_strlen(name) != 9)
+        return 0;
+
+    for (int i = 0; i < 9; i++)
+    {
+        int alpha = name[i] >= 'A' && name[i] <= 'Z';
+        int digit = name[i] >= '0' && name[i] <= '9';
+        if (i < 4 ? !alpha : !digit)
+            return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    char titleid[10];
+    const char* content;
+    const char* name;
+} ScanTitle;
+
+static ScanTitle scan_titles[MAX_SCAN_TITLES];
+// only titles with a stale cache are requested, scan_stale maps them back to scan_titles
+static pkgi_http_batch_item scan_requests[MAX_SCAN_TITLES];
+static char scan_url[MAX_SCAN_TITLES][128];
+static char scan_etag[MAX_SCAN_TITLES][64];
+static uint32_t scan_stale[MAX_SCAN_TITLES];
+static uint32_t scan_progress;
+static uint32_t scan_total;
+static uint32_t scan_failed;
+static int scan_updates;
+static UpdateCache scan_cache;
+
+static void add_cached_updates(const ScanTitle* title, const UpdateCache* cache)
+{
+    for (uint32_t i = 0; i < cache->count; i++)
+    {
+        scan_updates += add_update(title->content, title->name, &cache->updates[i]);
+    }
+}
+
+static int scan_done(uint32_t index, int status, const char* data, uint32_t size, const char* etag, void* user)
+{
+    pkgi_db_scan_func* progress = user;
+    const ScanTitle* title = &scan_titles[scan_stale[index]];
+    UpdateCache* cache = &scan_cache;
+    int parsed = (data && status != 304) ? parse_xml_updates(data, size, cache->updates) : -1;
+
+    if (status == 304 && load_update_cache(title->titleid, cache))
+    {
+        LOG("%s update list not modified", title->titleid);
+        cache->time = time(NULL);
+        save_update_cache(title->titleid, cache);
+        add_cached_updates(title, cache);
+    }
+    else if (parsed >= 0)
+    {
+        cache->count = parsed;
+        cache->time = time(NULL);
+        pkgi_strncpy(cache->etag, sizeof(cache->etag), etag);
+        save_update_cache(title->titleid, cache);
+        add_cached_updates(title, cache);
+    }
+    else if (status == 404)
+    {
+        // a title without updates answers 404, remember that too
+        cache->time = time(NULL);
+        cache->etag[0] = 0;
+        cache->count = 0;
+        save_update_cache(title->titleid, cache);
+    }
+    else
+    {
+        LOG("%s update list failed (%d)", title->titleid, status);
+        scan_failed++;
+        // an outdated answer is still better than none
+        if (load_update_cache(title->titleid, cache))
+        {
+            add_cached_updates(title, cache);
+        }
+    }
+
+    return progress ? progress(++scan_progress, scan_total) : 0;
+}
+
+// serves fresh titles from the cache and revalidates the rest over the network
+static int scan_updates_of(uint32_t count, pkgi_db_scan_func* progress)
+{
+    uint32_t stale = 0;
+    time_t now = time(NULL);
+
+    pkgi_mkdirs(UPDATE_CACHE_FOLDER);
+
+    scan_updates = 0;
+    scan_failed = 0;
+    scan_progress = 0;
+    scan_total = count;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const ScanTitle* title = &scan_titles[i];
+        UpdateCache* cache = &scan_cache;
+
+        if (load_update_cache(title->titleid, cache) && now >= cache->time && (uint64_t)(now - cache->time) < update_ttl)
+        {
+            add_cached_updates(title, cache);
+            scan_progress++;
+            continue;
+        }
+
+        pkgi_snprintf(scan_url[stale], sizeof(scan_url[stale]), UPDATE_XML_URL, title->titleid, title->titleid);
+        pkgi_strncpy(scan_etag[stale], sizeof(scan_etag[stale]), cache->etag);
+        scan_requests[stale].url = scan_url[stale];
+        scan_requests[stale].etag = scan_etag[stale][0] ? scan_etag[stale] : NULL;
+        scan_stale[stale] = i;
+        stale++;
+    }
+
+    LOG("%u of %u update lists cached", count - stale, count);
+    if (progress)
+    {
+        progress(scan_progress, scan_total);
+    }
+
+    // the new items stay hidden until pkgi_db_configure() runs on the main thread
+    pkgi_http_download_batch(scan_requests, stale, PKGI_SCAN_CONNECTIONS, &scan_done, progress);
+
+    return scan_updates;
+}
+
+int pkgi_db_load_xml_updates(const char* content_id, const char* name)
+{
+    ScanTitle* title = &scan_titles[0];
+    pkgi_snprintf(title->titleid, sizeof(title->titleid), "%.9s", content_id + 7);
+    title->content = content_id;
+    title->name = name;
+
+    LOG("Loading updates of %s...", title->titleid);
+    int updates = scan_updates_of(1, NULL);
+
+    return scan_failed ? -1 : updates;
+}
+
+int pkgi_db_scan_updates(pkgi_db_scan_func* progress)
+{
+    struct dirent* dir;
+    uint32_t count = 0;
+
+    if (!db_data)
+    {
+        return -1;
+    }
+
+    DIR* d = opendir(PKGI_GAME_FOLDER);
+    if (!d)
+    {
+        LOG("cannot open %s", PKGI_GAME_FOLDER);
+        return -1;
+    }
+
+    while ((dir = readdir(d)) != NULL && count < MAX_SCAN_TITLES)
+    {
+        if (!is_title_id(dir->d_name))
+            continue;
+
+        ScanTitle* title = &scan_titles[count];
+        pkgi_strncpy(title->titleid, sizeof(title->titleid), dir->d_name);
+        title->content = NULL;
+        title->name = title->titleid;
+
+        // the name and content id come from the database when the title is listed there
+        for (uint32_t i = 0; i < db_count; i++)
+        {
+            if (db[i].type != ContentUpdate && pkgi_memequ(db[i].content + 7, title->titleid, 9))
+            {
+                title->content = db[i].content;
+                title->name = db[i].name;
+                break;
+            }
         }
+        count++;
     }
+    closedir(d);
 
-    /*free the document */
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
-    free(buffer);
+    LOG("scanning updates of %u installed titles", count);
+    int updates = scan_updates_of(count, progress);
 
+    LOG("found %d updates", updates);
     return updates;
 }
@@ -1,6 +1,7 @@
 #include "pkgi_dialog.h"
 #include "pkgi_style.h"
 #include "pkgi_utils.h"
+#include "pkgi_icon.h"
 #include "pkgi.h"
 
 #include <sysutil/msg.h>
@@ -23,7 +24,6 @@ static char dialog_eta[256];
 static float dialog_progress;
 static int dialog_allow_close;
 static int dialog_cancelled;
-static pkgi_texture pkg_icon = NULL;
 static DbItem* db_item = NULL;
 static pkgi_dialog_callback_t dialog_callback = NULL;
 
@@ -73,13 +73,10 @@ void pkgi_dialog_details(DbItem *item, const char* content_type)
 {
     pkgi_dialog_lock();
 
-    pkgi_snprintf(dialog_extra, sizeof(dialog_extra), PKGI_TMP_FOLDER "/%.9s.PNG", item->content + 7);
-    if (!pkg_icon && pkgi_get_size(dialog_extra)) 
-        pkg_icon = pkgi_load_png_file(dialog_extra);
-
-    pkgi_snprintf(dialog_extra, sizeof(dialog_extra), "ID: %s\n\n%s: %s - RAP(%s) SHA256(%s)", 
+    pkgi_snprintf(dialog_extra, sizeof(dialog_extra), "ID: %s\n\n%s: %s - RAP(%s) %s(%s)", 
         item->content, _("Content"), content_type,
         (item->rap ? PKGI_UTF8_CHECK_ON : PKGI_UTF8_CHECK_OFF),
+        (item->digest_type == DigestSha1 ? "SHA1" : "SHA256"),
         (item->digest ? PKGI_UTF8_CHECK_ON : PKGI_UTF8_CHECK_OFF));
 
     pkgi_dialog_data_init(DialogDetails, item->name, dialog_extra);
@@ -111,6 +108,19 @@ void pkgi_dialog_error(const char* text)
     pkgi_dialog_unlock();
 }
 
+int pkgi_dialog_get_error(char* text, uint32_t size)
+{
+    pkgi_dialog_lock();
+    int error = dialog_type == DialogError;
+    if (error)
+    {
+        pkgi_strncpy(text, size, dialog_text);
+    }
+    pkgi_dialog_unlock();
+
+    return error;
+}
+
 void pkgi_dialog_start_progress(const char* title, const char* text, float progress)
 {
     pkgi_dialog_lock();
@@ -199,12 +209,6 @@ void pkgi_do_dialog(pkgi_input* input)
             dialog_height = 0;
             dialog_delta = 0;
 
-            if (pkg_icon)
-            {
-                pkgi_free_texture(pkg_icon);
-                pkg_icon = NULL;
-            }
-
             pkgi_dialog_unlock();
             return;
         }
@@ -328,7 +332,11 @@ void pkgi_do_dialog(pkgi_input* input)
     }
     else if (local_type == DialogDetails)
     {
-        pkgi_draw_texture_z(pkg_icon, PKGI_DIALOG_HMARGIN + PKGI_DIALOG_PADDING + 425, PKGI_DIALOG_VMARGIN + PKGI_DIALOG_PADDING + 25, PKGI_DIALOG_TEXT_Z, 0.5);
+        pkgi_texture pkg_icon = pkgi_icon_get(db_item->content);
+        if (pkg_icon)
+        {
+            pkgi_draw_texture_z(pkg_icon, PKGI_DIALOG_HMARGIN + PKGI_DIALOG_PADDING + 425, PKGI_DIALOG_VMARGIN + PKGI_DIALOG_PADDING + 25, PKGI_DIALOG_TEXT_Z, 0.5);
+        }
 
         pkgi_draw_text_z(PKGI_DIALOG_HMARGIN + PKGI_DIALOG_PADDING, PKGI_DIALOG_VMARGIN + PKGI_DIALOG_PADDING + font_height*2, PKGI_DIALOG_TEXT_Z, PKGI_COLOR_TEXT_DIALOG, local_text);
         pkgi_draw_text_z(PKGI_DIALOG_HMARGIN + PKGI_DIALOG_PADDING, PKGI_DIALOG_VMARGIN + PKGI_DIALOG_PADDING + font_height*5, PKGI_DIALOG_TEXT_Z, PKGI_COLOR_TEXT_DIALOG, local_extra);
@@ -3,11 +3,14 @@
 #include "pkgi.h"
 #include "pkgi_utils.h"
 #include "pkgi_sha256.h"
+#include "pkgi_speed.h"
+#include "pkgi_queue.h"
 #include "pdb_data.h"
 
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <stdio.h>
+#include <malloc.h>
 #include <dirent.h>
 #include <mini18n.h>
 
@@ -22,24 +25,146 @@
 #define PDB_HDR_UNUSED		"\x00\x00\x00\x00"
 #define PDB_HDR_DLSIZE		"\x00\x00\x00\xD0"
 
+#define WRITE_RING_SLOTS		8
+#define WRITE_RING_SLOT_SIZE	(256*1024)
+#define WRITE_BUFFER_ALIGN		(64*1024)
+
+#define CHUNK_SIZE				(16*1024*1024)
+#define VERIFY_READ_SIZE		(1024*1024)
+#define PKG_FOOTER_SIZE			32
+
+#define MAX_MIRRORS				8
+#define PROBE_SIZE				4096
+
+#define RETRY_BASE_DELAY		1000
+#define RETRY_MAX_DELAY			(60*1000)
+
+typedef struct
+{
+    uint8_t* data;
+    uint32_t size;
+} write_slot;
+
+typedef struct
+{
+    const char* url;
+    uint32_t latency;   // msec to fetch the first PROBE_SIZE bytes
+    int failed;         // returned a permanent error, not used again
+} mirror;
+
+// whole pkg hashes, SHA-1 is only kept for items verified against an update xml sha1sum
+typedef struct
+{
+    sha256_context sha256;
+    sha1_context sha1;
+} pkg_hash;
+
+// persisted in the .resume file, data below offset has been written and hashed
+typedef struct
+{
+    uint64_t offset;
+    uint64_t total_size;        // pkg size, the SHA-1 can only be rebuilt knowing where the footer starts
+    uint32_t chunks;            // chunk hashes were kept, the states below are valid
+    pkg_hash sha;
+    sha256_context chunk_sha;   // incomplete chunk at offset
+    pkg_hash chunk_start_sha;   // whole pkg hash at the start of that chunk
+} resume_data;
+
+// resume file of older versions, without the pkg size
+typedef struct
+{
+    uint64_t offset;
+    uint32_t chunks;
+    pkg_hash sha;
+    sha256_context chunk_sha;
+    pkg_hash chunk_start_sha;
+} resume_data_no_size;
+
+// resume file of older versions, without the chunk hash state
+typedef struct
+{
+    uint64_t offset;
+    pkg_hash sha;
+} resume_data_pkg_hash;
+
+// resume file of older versions, without the SHA-1 state
+typedef struct
+{
+    uint64_t offset;
+    sha256_context sha;
+} resume_data_sha256;
+
 
 static char root[256];
+static pkgi_mutex icon_fetch_lock;
+static resume_data resume_state;
+static int resume_chunks; // resume_state holds the chunk hash state
 static char resume_file[256];
+static char chunks_file[256];
 
 static pkgi_http* http;
 static const DbItem* db_item;
 static int download_resume;
 
+// item url and its mirrors, fastest first
+static mirror mirror_list[MAX_MIRRORS];
+static uint32_t mirror_total;
+static uint32_t mirror_current;
+static uint32_t probe_received;
+static int length_error;
+
 static uint64_t initial_offset;  // where http download resumes
+static uint64_t resume_offset;   // high-water mark loaded from resume file
 static uint64_t download_offset; // pkg absolute offset
 static uint64_t download_size;   // pkg total size (from http request)
 
-static sha256_context sha;
+static pkg_hash sha;
+static int hash_sha1; // 0 when the item has no SHA-1 digest or its SHA-1 state was lost
 
 static void* item_file;     // current file handle
 static char item_name[256]; // current file name
 static char item_path[256]; // current file path
 
+// received data is handed to the writer thread, which writes and hashes it
+static write_slot write_ring[WRITE_RING_SLOTS];
+static uint32_t ring_head;      // slot being filled by the curl callback
+static uint32_t ring_tail;      // slot being consumed by the writer thread
+static int ring_filling;
+static pkgi_sem ring_free;
+static pkgi_sem ring_ready;
+static pkgi_sem ring_done;
+static volatile int write_error;
+
+// write-behind buffer, coalesces ring slots into large sequential writes
+static uint32_t write_buffer_size;
+static uint8_t* write_buffer;
+static uint32_t write_buffer_used;
+static uint64_t write_buffer_offset; // file offset of write_buffer[0], or of next unbuffered write
+
+// resume state is saved every checkpoint_size bytes written
+static uint64_t checkpoint_size;
+static uint64_t next_checkpoint;
+
+// failed transfers are retried from where they stopped
+static uint32_t retry_count;
+
+// SHA-256 of every CHUNK_SIZE piece of the pkg, as received and as listed by the remote manifest
+static int verify_chunks;
+static int chunk_manifest;
+static uint8_t (*chunk_digest)[SHA256_DIGEST_SIZE];
+static uint32_t chunk_capacity;
+static uint8_t (*remote_digest)[SHA256_DIGEST_SIZE];
+static uint32_t remote_count;
+static sha256_context chunk_sha;       // current chunk, up to hash_offset
+static pkg_hash chunk_start_sha;       // whole pkg hash at the start of the current chunk
+static uint64_t hash_offset;           // pkg data hashed so far
+static volatile int chunk_error;
+static volatile int disk_error;        // the pkg file could not be written, so retrying cannot help
+
+// chunk downloaded again while verifying a resumed file
+static uint64_t refetch_offset;
+static uint32_t refetch_left;
+
 
 // pkg header
 static uint64_t total_size;
@@ -47,8 +172,8 @@ static uint64_t total_size;
 // UI stuff
 static char dialog_extra[256];
 static char dialog_eta[256];
-static uint32_t info_start;
 static uint32_t info_update;
+static pkgi_speed download_speed;
 
 static uint32_t	queue_task_id 	= 10000002;
 static uint32_t	install_task_id = 80000002;
@@ -129,7 +254,7 @@ static int create_queue_pdb_files(void)
 	write_pdb_string(fpPDB, PDB_HDR_DATETIME, "Mon, 11 Dec 2017 11:45:10 GMT");
 
 	// 000000CA - PKG Link download URL
-	write_pdb_string(fpPDB, PDB_HDR_URL, db_item->url);
+	write_pdb_string(fpPDB, PDB_HDR_URL, mirror_list[mirror_current].url);
 
 	// 0000006A - Icon location / path (PNG w/o extension) 
 	write_pdb_string(fpPDB, PDB_HDR_ICON, szIconFile);
@@ -205,22 +330,38 @@ static int create_install_pdb_files(const char *path, uint64_t size)
     return 1;
 }
 
-static void calculate_eta(uint32_t speed)
+static int format_duration(char* text, uint32_t size, uint32_t seconds)
 {
-    uint64_t seconds = (download_size - download_offset) / speed;
     if (seconds < 60)
     {
-        pkgi_snprintf(dialog_eta, sizeof(dialog_eta), "%s: %us", _("ETA"), (uint32_t)seconds);
+        return pkgi_snprintf(text, size, "%us", seconds);
     }
     else if (seconds < 3600)
     {
-        pkgi_snprintf(dialog_eta, sizeof(dialog_eta), "%s: %um %02us", _("ETA"), (uint32_t)(seconds / 60), (uint32_t)(seconds % 60));
+        return pkgi_snprintf(text, size, "%um %02us", seconds / 60, seconds % 60);
     }
-    else
+    return pkgi_snprintf(text, size, "%uh %02um", seconds / 3600, (seconds % 3600) / 60);
+}
+
+static void calculate_eta(void)
+{
+    uint64_t remaining = total_size > download_offset ? total_size - download_offset : 0;
+    uint32_t seconds = pkgi_speed_eta(&download_speed, remaining);
+    if (seconds == 0)
+    {
+        dialog_eta[0] = 0;
+        return;
+    }
+
+    int len = pkgi_snprintf(dialog_eta, sizeof(dialog_eta), "%s: ", _("ETA"));
+    len += format_duration(dialog_eta + len, sizeof(dialog_eta) - len, seconds);
+
+    // the rest of the download queue runs at the same speed
+    uint64_t queued = pkgi_queue_size(db_item->content);
+    if (queued)
     {
-        uint32_t hours = (uint32_t)(seconds / 3600);
-        uint32_t minutes = (uint32_t)((seconds - hours * 3600) / 60);
-        pkgi_snprintf(dialog_eta, sizeof(dialog_eta), "%s: %uh %02um", _("ETA"), hours, minutes);
+        len += pkgi_snprintf(dialog_eta + len, sizeof(dialog_eta) - len, "  %s: ", _("Queue"));
+        format_duration(dialog_eta + len, sizeof(dialog_eta) - len, pkgi_speed_eta(&download_speed, remaining + queued));
     }
 }
 
@@ -229,67 +370,471 @@ static int update_progress(void *p, int64_t dltotal, int64_t dlnow, int64_t ulto
 {
     uint32_t info_now = pkgi_time_msec();
 
+    pkgi_speed_update(&download_speed, download_offset);
+
     if (info_now >= info_update)
     {
         char text[256];
         pkgi_snprintf(text, sizeof(text), "%s", item_name);
 
-        if (download_resume)
+        // report download speed
+        uint32_t speed = pkgi_speed_rate(&download_speed);
+        if (speed > 10 * 1000 * 1024)
         {
-            // if resuming download, then there is no "download speed"
-            dialog_extra[0] = 0;
+            pkgi_snprintf(dialog_extra, sizeof(dialog_extra), "%u %s/s", speed / 1024 / 1024, _("MB"));
+        }
+        else if (speed > 1000)
+        {
+            pkgi_snprintf(dialog_extra, sizeof(dialog_extra), "%u %s/s", speed / 1024, _("KB"));
         }
         else
         {
-            // report download speed
-            uint32_t speed = (uint32_t)(((download_offset - initial_offset) * 1000) / (info_now - info_start));
-            if (speed > 10 * 1000 * 1024)
+            dialog_extra[0] = 0;
+        }
+
+        // total_size comes from the resume file or the http response length, until then there is no percent or ETA
+        calculate_eta();
+        float percent = total_size ? (float)((double)download_offset / total_size) : 0.f;
+
+        pkgi_dialog_update_progress(text, dialog_extra, dialog_eta, percent);
+        info_update = info_now + 500;
+    }
+
+    return (pkgi_dialog_is_cancelled());
+}
+
+static int flush_write_buffer(void)
+{
+    if (write_buffer_used == 0)
+    {
+        return 1;
+    }
+
+    int ret = pkgi_write_at(item_file, write_buffer_offset, write_buffer, write_buffer_used);
+    write_buffer_offset += write_buffer_used;
+    write_buffer_used = 0;
+
+    return ret;
+}
+
+static int buffered_write(const uint8_t* data, uint32_t size)
+{
+    if (!write_buffer)
+    {
+        int ret = pkgi_write_at(item_file, write_buffer_offset, data, size);
+        write_buffer_offset += size;
+        return ret;
+    }
+
+    while (size)
+    {
+        // flush on buffer-size boundaries of the file, so a resumed file gets aligned writes too
+        uint32_t room = write_buffer_size - (uint32_t)((write_buffer_offset + write_buffer_used) % write_buffer_size);
+        uint32_t count = min32(size, room);
+
+        pkgi_memcpy(write_buffer + write_buffer_used, data, count);
+        write_buffer_used += count;
+        data += count;
+        size -= count;
+
+        if (count == room && !flush_write_buffer())
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// written through a temp file, so a crash leaves either the old or the new contents
+static int save_file_atomic(const char* path, const void* data, uint32_t size)
+{
+    char temp[256];
+    pkgi_snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    if (!pkgi_save(temp, data, size))
+    {
+        LOG("error saving %s", path);
+        return 0;
+    }
+
+    if (rename(temp, path) != 0)
+    {
+        // lv2 fs does not promise POSIX rename over an existing file, replace it in two steps then;
+        // load_file_atomic falls back to the temp file if the old one is gone before the rename
+        if (pkgi_get_size(temp) <= 0)
+        {
+            LOG("error renaming %s, it is gone", temp);
+            return 0;
+        }
+
+        LOG("cannot rename %s over %s, removing it first", temp, path);
+        pkgi_rm(path);
+        if (rename(temp, path) != 0)
+        {
+            LOG("error renaming %s", temp);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int load_file_atomic(const char* path, void* data, uint32_t size)
+{
+    int loaded = pkgi_load(path, data, size);
+    if (loaded < 0)
+    {
+        char temp[256];
+        pkgi_snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+        loaded = pkgi_load(temp, data, size);
+        if (loaded >= 0)
+        {
+            LOG("%s is missing, using %s", path, temp);
+        }
+    }
+    return loaded;
+}
+
+static void rm_file_atomic(const char* path)
+{
+    char temp[256];
+    pkgi_snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    pkgi_rm(path);
+    pkgi_rm(temp);
+}
+
+static void hash_starts(void)
+{
+    sha256_init(&sha.sha256);
+    sha256_starts(&sha.sha256, 0);
+    sha1_init(&sha.sha1);
+    sha1_starts(&sha.sha1);
+}
+
+// pkg data at offset, the update xml sha1sum leaves out the pkg footer
+static void hash_update(uint64_t offset, const uint8_t* data, uint32_t size)
+{
+    sha256_update(&sha.sha256, data, size);
+
+    if (hash_sha1 && total_size > PKG_FOOTER_SIZE && offset < total_size - PKG_FOOTER_SIZE)
+    {
+        sha1_update(&sha.sha1, data, (size_t)min64(size, total_size - PKG_FOOTER_SIZE - offset));
+    }
+}
+
+static int save_resume_data(uint64_t offset)
+{
+    // chunk digests go first, the resume state must never refer to chunks missing from them
+    if (verify_chunks && !save_file_atomic(chunks_file, chunk_digest, (uint32_t)(offset / CHUNK_SIZE) * SHA256_DIGEST_SIZE))
+    {
+        return 0;
+    }
+
+    resume_data resume;
+    resume.offset = offset;
+    resume.total_size = total_size;
+    resume.chunks = verify_chunks;
+    resume.sha = sha;
+    resume.chunk_sha = chunk_sha;
+    resume.chunk_start_sha = chunk_start_sha;
+
+    return save_file_atomic(resume_file, &resume, sizeof(resume));
+}
+
+static int reserve_chunk_digests(uint32_t count)
+{
+    if (count <= chunk_capacity)
+    {
+        return 1;
+    }
+
+    uint8_t (*digests)[SHA256_DIGEST_SIZE] = pkgi_malloc(count * SHA256_DIGEST_SIZE);
+    if (!digests)
+    {
+        LOG("no memory for %u chunk digests", count);
+        return 0;
+    }
+
+    if (chunk_digest)
+    {
+        pkgi_memcpy(digests, chunk_digest, chunk_capacity * SHA256_DIGEST_SIZE);
+        pkgi_free(chunk_digest);
+    }
+
+    chunk_digest = digests;
+    chunk_capacity = count;
+    return 1;
+}
+
+static void free_chunk_digests(void)
+{
+    pkgi_free(chunk_digest);
+    pkgi_free(remote_digest);
+    chunk_digest = NULL;
+    remote_digest = NULL;
+    chunk_capacity = 0;
+    remote_count = 0;
+}
+
+static int finish_chunk(uint32_t index)
+{
+    sha256_finish(&chunk_sha, chunk_digest[index]);
+    sha256_starts(&chunk_sha, 0);
+
+    if (index < remote_count && !pkgi_memequ(chunk_digest[index], remote_digest[index], SHA256_DIGEST_SIZE))
+    {
+        LOG("chunk %u does not match the manifest", index);
+        return 0;
+    }
+
+    chunk_start_sha = sha;
+    return 1;
+}
+
+// hashes written data into the pkg hash, and into the chunk hashes when enabled
+static int hash_data(const uint8_t* data, uint32_t size)
+{
+    if (!verify_chunks)
+    {
+        hash_update(hash_offset, data, size);
+        hash_offset += size;
+        return 1;
+    }
+
+    while (size)
+    {
+        uint32_t count = min32(size, CHUNK_SIZE - (uint32_t)(hash_offset % CHUNK_SIZE));
+
+        hash_update(hash_offset, data, count);
+        sha256_update(&chunk_sha, data, count);
+        hash_offset += count;
+        data += count;
+        size -= count;
+
+        if ((hash_offset % CHUNK_SIZE == 0 || hash_offset == total_size) && !finish_chunk((uint32_t)((hash_offset - 1) / CHUNK_SIZE)))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// a corrupted chunk is dropped, resuming continues from its start
+static void rollback_chunk(void)
+{
+    uint64_t offset = (hash_offset - 1) / CHUNK_SIZE * CHUNK_SIZE;
+
+    sha = chunk_start_sha;
+    hash_offset = offset;
+    if (flush_write_buffer() && pkgi_sync(item_file))
+    {
+        save_resume_data(offset);
+    }
+}
+
+// the pkg data must be on disk before the resume state claims it
+static int write_checkpoint(void)
+{
+    if (!flush_write_buffer() || !pkgi_sync(item_file))
+    {
+        return 0;
+    }
+
+    LOG("checkpoint at %llu", write_buffer_offset);
+    save_resume_data(write_buffer_offset);
+    next_checkpoint = write_buffer_offset + checkpoint_size;
+    return 1;
+}
+
+static void write_thread(void)
+{
+    for (;;)
+    {
+        pkgi_sem_wait(ring_ready);
+
+        write_slot* slot = &write_ring[ring_tail];
+        if (slot->size == 0)
+        {
+            // end of data marker
+            if (!write_error && !flush_write_buffer())
             {
-                pkgi_snprintf(dialog_extra, sizeof(dialog_extra), "%u %s/s", speed / 1024 / 1024, _("MB"));
+                LOG("error flushing write buffer to %s", item_path);
+                write_error = 1;
+                disk_error = 1;
             }
-            else if (speed > 1000)
+            break;
+        }
+
+        if (!write_error)
+        {
+            if (buffered_write(slot->data, slot->size))
             {
-                pkgi_snprintf(dialog_extra, sizeof(dialog_extra), "%u %s/s", speed / 1024, _("KB"));
+                if (!hash_data(slot->data, slot->size))
+                {
+                    rollback_chunk();
+                    chunk_error = 1;
+                    write_error = 1;
+                }
+                else if (checkpoint_size && write_buffer_offset + write_buffer_used >= next_checkpoint && !write_checkpoint())
+                {
+                    LOG("error writing checkpoint for %s", item_path);
+                    write_error = 1;
+                    disk_error = 1;
+                }
             }
-
-            if (speed != 0)
+            else
             {
-                // report ETA
-                calculate_eta(speed);
+                LOG("error writing %u bytes to %s", slot->size, item_path);
+                write_error = 1;
+                disk_error = 1;
             }
         }
 
-        float percent;
-        if (download_resume)
+        ring_tail = (ring_tail + 1) % WRITE_RING_SLOTS;
+        pkgi_sem_post(ring_free);
+    }
+
+    pkgi_sem_post(ring_done);
+    pkgi_thread_exit();
+}
+
+static void ring_submit(void)
+{
+    ring_filling = 0;
+    ring_head = (ring_head + 1) % WRITE_RING_SLOTS;
+    pkgi_sem_post(ring_ready);
+}
+
+static write_slot* ring_acquire(void)
+{
+    write_slot* slot = &write_ring[ring_head];
+
+    if (!ring_filling)
+    {
+        pkgi_sem_wait(ring_free);
+        slot->size = 0;
+        ring_filling = 1;
+    }
+
+    return slot;
+}
+
+static void free_write_ring(void)
+{
+    for (int i = 0; i < WRITE_RING_SLOTS; i++)
+    {
+        pkgi_free(write_ring[i].data);
+        write_ring[i].data = NULL;
+    }
+
+    pkgi_free(write_buffer);
+    write_buffer = NULL;
+}
+
+static int start_write_ring(void)
+{
+    ring_head = 0;
+    ring_tail = 0;
+    ring_filling = 0;
+    write_error = 0;
+    chunk_error = 0;
+
+    for (int i = 0; i < WRITE_RING_SLOTS; i++)
+    {
+        write_ring[i].size = 0;
+        write_ring[i].data = pkgi_malloc(WRITE_RING_SLOT_SIZE);
+        if (!write_ring[i].data)
         {
-            // if resuming, then we may not know download size yet, use total_size from pkg header
-            percent = total_size ? (float)((double)download_offset / total_size) : 0.f;
+            LOG("failed to allocate write buffers");
+            free_write_ring();
+            return 0;
         }
-        else
+    }
+
+    write_buffer_used = 0;
+    write_buffer_offset = initial_offset;
+    next_checkpoint = initial_offset + checkpoint_size;
+    if (write_buffer_size)
+    {
+        write_buffer = memalign(WRITE_BUFFER_ALIGN, write_buffer_size);
+        if (!write_buffer)
         {
-            // when downloading use content length from http response as download size
-            percent = download_size ? (float)((double)download_offset / download_size) : 0.f;
+            LOG("no memory for %u bytes write buffer, writing unbuffered", write_buffer_size);
         }
+    }
 
-        pkgi_dialog_update_progress(text, dialog_extra, dialog_eta, percent);
-        info_update = info_now + 500;
+    if (!pkgi_sem_create(&ring_free, WRITE_RING_SLOTS, WRITE_RING_SLOTS)) goto fail_buffers;
+    if (!pkgi_sem_create(&ring_ready, 0, WRITE_RING_SLOTS)) goto fail_free;
+    if (!pkgi_sem_create(&ring_done, 0, 1)) goto fail_ready;
+
+    if (pkgi_start_thread("write_thread", &write_thread))
+    {
+        return 1;
     }
 
-    return (pkgi_dialog_is_cancelled());
+    pkgi_sem_destroy(ring_done);
+fail_ready:
+    pkgi_sem_destroy(ring_ready);
+fail_free:
+    pkgi_sem_destroy(ring_free);
+fail_buffers:
+    free_write_ring();
+    return 0;
+}
+
+// waits until the writer thread has written and hashed everything received so far
+static int stop_write_ring(void)
+{
+    if (ring_filling && write_ring[ring_head].size)
+    {
+        ring_submit();
+    }
+
+    // an empty slot tells the writer thread to finish
+    ring_acquire();
+    ring_submit();
+    pkgi_sem_wait(ring_done);
+
+    pkgi_sem_destroy(ring_free);
+    pkgi_sem_destroy(ring_ready);
+    pkgi_sem_destroy(ring_done);
+    free_write_ring();
+
+    return !write_error;
 }
 
 static size_t write_verify_data(void *buffer, size_t size, size_t nmemb, void *stream)
 {
     size_t realsize = size * nmemb;
+    const uint8_t* data = buffer;
+    size_t left = realsize;
 
-    if (pkgi_write(item_file, buffer, realsize))
+    if (write_error)
     {
-        download_offset += realsize;
-        sha256_update(&sha, buffer, realsize);
-        return (realsize);
+        return 0;
     }
 
-    return 0;
+    while (left)
+    {
+        write_slot* slot = ring_acquire();
+        uint32_t count = min32(left, WRITE_RING_SLOT_SIZE - slot->size);
+
+        pkgi_memcpy(slot->data + slot->size, data, count);
+        slot->size += count;
+        data += count;
+        left -= count;
+
+        if (slot->size == WRITE_RING_SLOT_SIZE)
+        {
+            ring_submit();
+        }
+    }
+
+    download_offset += realsize;
+    return (realsize);
 }
 
 static int create_dummy_pkg(void)
@@ -318,8 +863,8 @@ static int queue_pkg_task(void)
     char pszPKGDir[256];
     int64_t http_length;
 
-    LOG("requesting %s @ %llu", db_item->url, initial_offset);
-    http = pkgi_http_get(db_item->url, db_item->content, initial_offset);
+    LOG("requesting %s @ %llu", mirror_list[mirror_current].url, initial_offset);
+    http = pkgi_http_get(mirror_list[mirror_current].url, db_item->content, initial_offset);
     if (!http)
     {
         pkgi_dialog_error(_("Could not send HTTP request"));
@@ -356,7 +901,7 @@ static int queue_pkg_task(void)
 	}
 
     LOG("http response length = %lld, total pkg size = %llu", http_length, download_size);
-    info_start = pkgi_time_msec();
+    pkgi_speed_reset(&download_speed, download_offset);
     info_update = pkgi_time_msec() + 500;
 
     pkgi_dialog_set_progress_title(_("Saving background task..."));
@@ -387,56 +932,310 @@ static void download_start(void)
     pkgi_dialog_set_progress_title(_("Downloading..."));
 }
 
-static int download_data(void)
+static int check_download_length(int64_t http_length)
 {
-    if (!http)
+    if (http_length < 0)
     {
-        LOG("requesting %s @ %llu", db_item->url, initial_offset);
-        http = pkgi_http_get(db_item->url, db_item->content, initial_offset);
-        if (!http)
-        {
-            pkgi_dialog_error(_("Could not send HTTP request"));
-            return 0;
-        }
-
-        int64_t http_length;
-        if (!pkgi_http_response_length(http, &http_length))
-        {
-            pkgi_dialog_error(_("HTTP request failed"));
-            return 0;
-        }
-        if (http_length < 0)
-        {
-            pkgi_dialog_error(_("HTTP response has unknown length"));
-            return 0;
-        }
-
-        download_size = http_length;
-        total_size = initial_offset + download_size;
+        pkgi_dialog_error(_("HTTP response has unknown length"));
+        length_error = 1;
+        return 0;
+    }
 
-        if (!pkgi_check_free_space(http_length))
-        {
-            LOG("error! out of space");
-            return 0;
-        }
+    download_size = http_length;
+    total_size = initial_offset + download_size;
 
-        LOG("http response length = %lld, total pkg size = %llu", http_length, total_size);
-        info_start = pkgi_time_msec();
-        info_update = pkgi_time_msec() + 500;
+    // a resumed file is usually preallocated already, only the growth needs space
+    int64_t current_size = pkgi_get_size(item_path);
+    if (current_size < 0)
+    {
+        current_size = 0;
     }
 
-    if (!pkgi_http_read(http, &write_verify_data, &update_progress))
+    if ((uint64_t)current_size < total_size && !pkgi_check_free_space(total_size - current_size))
     {
-        pkgi_save(resume_file, &sha, sizeof(sha));
-
-        if (!pkgi_dialog_is_cancelled())
-        {
-            pkgi_dialog_error(_("HTTP download error"));
-        }
+        LOG("error! out of space");
+        length_error = 1;
         return 0;
     }
 
-    return 1;
+    // reserve the whole pkg up front, data is written at explicit offsets
+    if ((uint64_t)current_size != total_size && truncate(item_path, total_size) != 0)
+    {
+        LOG("error preallocating %s to %llu bytes", item_path, total_size);
+        pkgi_dialog_error(_("Could not create PKG file to HDD."));
+        length_error = 1;
+        return 0;
+    }
+
+    if (verify_chunks)
+    {
+        uint32_t count = (uint32_t)((total_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        if (!reserve_chunk_digests(count))
+        {
+            pkgi_dialog_error(_("Could not allocate download buffers"));
+            length_error = 1;
+            return 0;
+        }
+
+        if (remote_count && remote_count != count)
+        {
+            LOG("chunk manifest has %u chunks instead of %u, ignoring it", remote_count, count);
+            remote_count = 0;
+        }
+    }
+
+    LOG("http response length = %lld, total pkg size = %llu", http_length, total_size);
+    pkgi_speed_reset(&download_speed, download_offset);
+    info_update = pkgi_time_msec() + 500;
+
+    return 1;
+}
+
+static size_t probe_data(void *buffer, size_t size, size_t nmemb, void *stream)
+{
+    size_t realsize = size * nmemb;
+
+    // stop servers that ignore the range and send the whole pkg
+    probe_received += realsize;
+    return (probe_received > PROBE_SIZE ? 0 : realsize);
+}
+
+static uint32_t probe_mirror(const char* url)
+{
+    uint32_t start = pkgi_time_msec();
+
+    pkgi_http* probe = pkgi_http_get_range(url, 0, PROBE_SIZE);
+    if (!probe)
+    {
+        return UINT32_MAX;
+    }
+
+    probe_received = 0;
+    int ok = pkgi_http_read(probe, &probe_data, NULL, NULL) || probe_received > PROBE_SIZE;
+    pkgi_http_close(probe);
+
+    return (ok ? pkgi_time_msec() - start : UINT32_MAX);
+}
+
+// collects the item url and its mirrors, and sorts them by probed latency
+static void select_mirrors(void)
+{
+    mirror_total = 0;
+    mirror_current = 0;
+
+    mirror_list[mirror_total].url = db_item->url;
+    mirror_list[mirror_total].latency = 0;
+    mirror_list[mirror_total].failed = 0;
+    mirror_total++;
+
+    const char* url = db_item->mirrors;
+    for (uint32_t i = 0; i < db_item->mirror_count && mirror_total < MAX_MIRRORS; i++)
+    {
+        while (*url == 0)
+        {
+            url++;
+        }
+
+        if (pkgi_validate_url(url))
+        {
+            mirror_list[mirror_total].url = url;
+            mirror_list[mirror_total].latency = 0;
+            mirror_list[mirror_total].failed = 0;
+            mirror_total++;
+        }
+        url += pkgi_strlen(url) + 1;
+    }
+
+    if (mirror_total == 1)
+    {
+        return;
+    }
+
+    pkgi_dialog_update_progress(_("Checking mirrors..."), NULL, NULL, 0.f);
+    for (uint32_t i = 0; i < mirror_total; i++)
+    {
+        mirror_list[i].latency = probe_mirror(mirror_list[i].url);
+        LOG("mirror %s: %u ms", mirror_list[i].url, mirror_list[i].latency);
+
+        // insertion sort, unreachable mirrors keep their order at the end
+        mirror m = mirror_list[i];
+        uint32_t j = i;
+        for (; j > 0 && mirror_list[j - 1].latency > m.latency; j--)
+        {
+            mirror_list[j] = mirror_list[j - 1];
+        }
+        mirror_list[j] = m;
+    }
+
+    LOG("using mirror %s", mirror_list[0].url);
+}
+
+// moves to the next mirror that has not failed for good, returns 0 if there is none
+static int next_mirror(void)
+{
+    for (uint32_t i = 1; i <= mirror_total; i++)
+    {
+        uint32_t index = (mirror_current + i) % mirror_total;
+        if (!mirror_list[index].failed)
+        {
+            mirror_current = index;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t usable_mirrors(void)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < mirror_total; i++)
+    {
+        count += !mirror_list[i].failed;
+    }
+    return count;
+}
+
+// jittered exponential backoff, returns 0 if the user cancels while waiting
+static int wait_retry(uint32_t retry)
+{
+    uint32_t delay = min32(RETRY_BASE_DELAY << min32(retry - 1, 16), RETRY_MAX_DELAY);
+    delay = delay / 2 + pkgi_time_msec() % (delay / 2 + 1);
+
+    LOG("retry %u of %u in %u ms", retry, retry_count, delay);
+    uint32_t end = pkgi_time_msec() + delay;
+
+    for (uint32_t now = pkgi_time_msec(); now < end; now = pkgi_time_msec())
+    {
+        char text[256];
+        pkgi_snprintf(text, sizeof(text), _("Download interrupted, retrying in %u s (%u/%u)"), (end - now + 999) / 1000, retry, retry_count);
+        pkgi_dialog_update_progress(text, NULL, NULL, total_size ? (float)((double)hash_offset / total_size) : 0.f);
+
+        if (pkgi_dialog_is_cancelled())
+        {
+            return 0;
+        }
+        pkgi_sleep(100);
+    }
+
+    return 1;
+}
+
+static void report_disk_error(void)
+{
+    char error[256];
+    pkgi_snprintf(error, sizeof(error), "%s %s", _("cannot write file"), item_name);
+    pkgi_dialog_error(error);
+}
+
+static int download_data(void)
+{
+    uint32_t retry = 0;
+    uint32_t failures = 0;
+
+    for (;;)
+    {
+        uint64_t start_offset = initial_offset;
+
+        if (!http)
+        {
+            LOG("requesting %s @ %llu", mirror_list[mirror_current].url, initial_offset);
+            http = pkgi_http_get(mirror_list[mirror_current].url, db_item->content, initial_offset);
+            if (!http)
+            {
+                pkgi_dialog_error(_("Could not send HTTP request"));
+                return 0;
+            }
+        }
+
+        if (!start_write_ring())
+        {
+            pkgi_dialog_error(_("Could not allocate download buffers"));
+            return 0;
+        }
+
+        // content length is checked from the GET response headers, before any data is written
+        length_error = 0;
+        int ok = pkgi_http_read(http, &write_verify_data, &check_download_length, &update_progress);
+
+        // the sha256 context matches the file contents only once the writer is drained
+        int written = stop_write_ring();
+        if (ok && written)
+        {
+            return 1;
+        }
+
+        if (length_error)
+        {
+            return 0;
+        }
+
+        // after a write error the hash may cover data that never reached the file,
+        // so keep the last checkpoint instead, the same if it cannot be synced
+        if (written && pkgi_sync(item_file))
+        {
+            save_resume_data(hash_offset);
+        }
+
+        LOG("download failed @ %llu: %s", hash_offset, chunk_error ? "chunk verification failed" : written ? pkgi_http_error(http) : "write error");
+
+        int can_retry = !pkgi_dialog_is_cancelled() && (chunk_error || written);
+        int transient = chunk_error || pkgi_http_can_retry(http);
+
+        pkgi_http_close(http);
+        http = NULL;
+
+        // the budget counts retries in a row that made no progress
+        if (hash_offset > start_offset)
+        {
+            retry = 0;
+            failures = 0;
+        }
+
+        if (!can_retry)
+        {
+            break;
+        }
+
+        if (!transient)
+        {
+            LOG("giving up on mirror %s", mirror_list[mirror_current].url);
+            mirror_list[mirror_current].failed = 1;
+        }
+
+        if (!next_mirror())
+        {
+            break;
+        }
+
+        // switch mirrors right away, back off once every mirror has failed
+        if (++failures >= usable_mirrors())
+        {
+            failures = 0;
+            if (retry >= retry_count || !wait_retry(++retry))
+            {
+                break;
+            }
+        }
+        LOG("continuing from %s", mirror_list[mirror_current].url);
+
+        initial_offset = hash_offset;
+        download_offset = hash_offset;
+        pkgi_speed_reset(&download_speed, download_offset);
+    }
+
+    if (chunk_error)
+    {
+        pkgi_dialog_error(_("pkg chunk verification failed, resume to download it again"));
+    }
+    else if (disk_error)
+    {
+        report_disk_error();
+    }
+    else if (!pkgi_dialog_is_cancelled())
+    {
+        pkgi_dialog_error(_("HTTP download error"));
+    }
+    return 0;
 }
 
 // this includes creating of all the parent folders necessary to actually create file
@@ -471,7 +1270,7 @@ static int create_file(void)
 static int resume_partial_file(void)
 {
     LOG("resuming %s file", item_name);
-    item_file = pkgi_append(item_path);
+    item_file = pkgi_open_rw(item_path);
     if (!item_file)
     {
         char error[256];
@@ -483,6 +1282,291 @@ static int resume_partial_file(void)
     return 1;
 }
 
+static void load_remote_manifest(void)
+{
+    char url[512];
+    uint32_t size;
+
+    pkgi_snprintf(url, sizeof(url), "%s.chunks", mirror_list[mirror_current].url);
+    char* manifest = pkgi_http_download_buffer(url, &size);
+    if (!manifest)
+    {
+        LOG("no chunk manifest at %s", url);
+        return;
+    }
+
+    // one hex digest per line, each takes at least 2*SHA256_DIGEST_SIZE bytes
+    remote_digest = pkgi_malloc((size / (2 * SHA256_DIGEST_SIZE) + 1) * SHA256_DIGEST_SIZE);
+    remote_count = 0;
+
+    char* ptr = manifest;
+    while (remote_digest && *ptr)
+    {
+        while (*ptr == ' ' || *ptr == '\r' || *ptr == '\n')
+        {
+            ptr++;
+        }
+        if (*ptr == 0)
+        {
+            break;
+        }
+
+        char* end = ptr;
+        while (*end && *end != ' ' && *end != '\r' && *end != '\n')
+        {
+            end++;
+        }
+
+        if (end - ptr != 2 * SHA256_DIGEST_SIZE)
+        {
+            LOG("invalid chunk manifest line %u, ignoring it", remote_count + 1);
+            remote_count = 0;
+            break;
+        }
+
+        pkgi_memcpy(remote_digest[remote_count++], pkgi_hexbytes(ptr, SHA256_DIGEST_SIZE), SHA256_DIGEST_SIZE);
+        ptr = end;
+    }
+
+    LOG("chunk manifest with %u chunks loaded", remote_count);
+    free(manifest);
+}
+
+static size_t refetch_data(void *buffer, size_t size, size_t nmemb, void *stream)
+{
+    size_t realsize = size * nmemb;
+
+    if (realsize > refetch_left)
+    {
+        return 0;
+    }
+
+    if (!pkgi_write_at(item_file, refetch_offset, buffer, realsize))
+    {
+        LOG("error writing %u bytes to %s", (uint32_t)realsize, item_path);
+        disk_error = 1;
+        return 0;
+    }
+
+    hash_update(refetch_offset, buffer, realsize);
+    sha256_update(&chunk_sha, buffer, realsize);
+    refetch_offset += realsize;
+    refetch_left -= realsize;
+    return realsize;
+}
+
+static int refetch_range(uint64_t offset, uint32_t size)
+{
+    sha = chunk_start_sha;
+
+    LOG("downloading again %u bytes @ %llu", size, offset);
+    pkgi_http* range_http = pkgi_http_get_range(mirror_list[mirror_current].url, offset, size);
+    if (!range_http)
+    {
+        return 0;
+    }
+
+    refetch_offset = offset;
+    refetch_left = size;
+    sha256_starts(&chunk_sha, 0);
+
+    int ok = pkgi_http_read(range_http, &refetch_data, NULL, NULL);
+    pkgi_http_close(range_http);
+
+    return ok && refetch_left == 0;
+}
+
+// downloads a chunk again, trying the other mirrors if it fails or still does not match;
+// without a digest the chunk is incomplete and its hash continues while downloading.
+// returns 1 on success, 0 if no mirror could send it, -1 if the data sent did not match
+static int refetch_chunk(uint64_t offset, uint32_t size, const uint8_t* expected, uint8_t* digest)
+{
+    int result = 0;
+
+    for (uint32_t i = 0; i < mirror_total && !disk_error; i++)
+    {
+        if (refetch_range(offset, size))
+        {
+            if (!digest)
+            {
+                return 1;
+            }
+
+            sha256_finish(&chunk_sha, digest);
+            if (!expected || pkgi_memequ(digest, expected, SHA256_DIGEST_SIZE))
+            {
+                return 1;
+            }
+            LOG("chunk @ %llu from %s does not match", offset, mirror_list[mirror_current].url);
+            result = -1;
+        }
+
+        if (!next_mirror())
+        {
+            break;
+        }
+    }
+    return result;
+}
+
+// the saved hash state can be kept when every complete chunk has a local digest that agrees with the manifest,
+// the data on disk must still match those digests
+static int can_restore_resumed_data(uint32_t full_chunks, int have_local)
+{
+    if (!resume_chunks || !have_local || resume_state.offset != initial_offset)
+    {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < full_chunks && i < remote_count; i++)
+    {
+        if (!pkgi_memequ(chunk_digest[i], remote_digest[i], SHA256_DIGEST_SIZE))
+        {
+            LOG("chunk %u of %s does not match the manifest", i, item_name);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// rebuilds the hash state from the data on disk, downloading again any chunk that does not match
+static int verify_resumed_data(void)
+{
+    uint32_t full_chunks = (uint32_t)(initial_offset / CHUNK_SIZE);
+    uint32_t digests_size = full_chunks * SHA256_DIGEST_SIZE;
+
+    uint8_t* buffer = pkgi_malloc(VERIFY_READ_SIZE);
+    if (!buffer || !reserve_chunk_digests(full_chunks + 1))
+    {
+        pkgi_free(buffer);
+        pkgi_dialog_error(_("Could not allocate download buffers"));
+        return 0;
+    }
+
+    int have_local = load_file_atomic(chunks_file, chunk_digest, digests_size) == (int)digests_size;
+
+    // with a usable saved state only the chunk digests are checked, the whole pkg hash is not rebuilt
+    int restore = can_restore_resumed_data(full_chunks, have_local);
+    if (restore)
+    {
+        LOG("checking %u chunks of %s against the saved hash state", full_chunks, item_name);
+    }
+    else
+    {
+        LOG("verifying %u chunks of %s, %s local digests", full_chunks, item_name, have_local ? "with" : "without");
+
+        if (hash_sha1 && !total_size)
+        {
+            // older resume files do not know where the footer left out of the SHA-1 starts
+            LOG("pkg size unknown, the SHA-1 of %s cannot be rebuilt", item_name);
+            hash_sha1 = 0;
+        }
+        hash_starts();
+    }
+
+    int result = 0;
+    int refetched = 0;
+
+    for (uint32_t i = 0; i <= full_chunks; i++)
+    {
+        uint64_t start = (uint64_t)i * CHUNK_SIZE;
+        uint32_t size = (uint32_t)min64(CHUNK_SIZE, initial_offset - start);
+        int ok = 1;
+
+        pkgi_dialog_update_progress(_("Verifying..."), NULL, NULL, initial_offset ? (float)((double)start / initial_offset) : 1.f);
+        if (pkgi_dialog_is_cancelled())
+        {
+            goto bail;
+        }
+
+        if (!restore)
+        {
+            chunk_start_sha = sha;
+        }
+        sha256_starts(&chunk_sha, 0);
+
+        for (uint32_t done = 0; ok && done < size; )
+        {
+            uint32_t count = min32(size - done, VERIFY_READ_SIZE);
+            if (pkgi_read_at(item_file, start + done, buffer, count) != (int)count)
+            {
+                LOG("cannot read chunk %u of %s", i, item_path);
+                ok = 0;
+                break;
+            }
+
+            if (!restore)
+            {
+                hash_update(start + done, buffer, count);
+            }
+            sha256_update(&chunk_sha, buffer, count);
+            done += count;
+        }
+
+        if (size < CHUNK_SIZE && restore)
+        {
+            // the saved state of the incomplete last chunk tells what its data on disk must be
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            uint8_t expected[SHA256_DIGEST_SIZE];
+            sha256_context saved = resume_state.chunk_sha;
+            sha256_finish(&saved, expected);
+            sha256_finish(&chunk_sha, digest);
+
+            if (size && (!ok || !pkgi_memequ(digest, expected, SHA256_DIGEST_SIZE)))
+            {
+                LOG("chunk %u of %s is corrupted", i, item_path);
+                if ((refetched = refetch_chunk(start, size, expected, digest)) != 1) goto bail;
+            }
+            break;
+        }
+
+        if (size < CHUNK_SIZE)
+        {
+            // the last chunk is incomplete, its hash continues while downloading
+            if (!ok && (refetched = refetch_chunk(start, size, NULL, NULL)) != 1) goto bail;
+            break;
+        }
+
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256_finish(&chunk_sha, digest);
+
+        const uint8_t* expected = i < remote_count ? remote_digest[i] : (have_local ? chunk_digest[i] : NULL);
+        if (!ok || (expected && !pkgi_memequ(digest, expected, SHA256_DIGEST_SIZE)))
+        {
+            LOG("chunk %u of %s is corrupted", i, item_path);
+
+            if ((refetched = refetch_chunk(start, CHUNK_SIZE, expected, digest)) != 1) goto bail;
+        }
+
+        pkgi_memcpy(chunk_digest[i], digest, SHA256_DIGEST_SIZE);
+    }
+
+    if (restore)
+    {
+        // chunks downloaded again match the data the saved states were computed from
+        sha = resume_state.sha;
+        chunk_sha = resume_state.chunk_sha;
+        chunk_start_sha = resume_state.chunk_start_sha;
+    }
+
+    hash_offset = initial_offset;
+    result = 1;
+
+bail:
+    pkgi_free(buffer);
+
+    if (!result && disk_error)
+    {
+        report_disk_error();
+    }
+    else if (!result && !pkgi_dialog_is_cancelled())
+    {
+        // a chunk no mirror could send again is a network problem, not bad data
+        pkgi_dialog_error(refetched == 0 ? _("HTTP download error") : _("pkg chunk verification failed, resume to download it again"));
+    }
+    return result;
+}
+
 static int download_pkg_file(void)
 {
     int result = 0;
@@ -493,8 +1577,22 @@ static int download_pkg_file(void)
 
     if (download_resume)
     {
-        initial_offset = pkgi_get_size(item_path);
+        initial_offset = resume_offset;
+    }
+
+    hash_offset = initial_offset;
+    chunk_start_sha = sha;
+    sha256_starts(&chunk_sha, 0);
+
+    if (verify_chunks && chunk_manifest)
+    {
+        load_remote_manifest();
+    }
+
+    if (download_resume)
+    {
         if (!resume_partial_file()) goto bail;
+        if (verify_chunks && !verify_resumed_data()) goto bail;
         download_start();
     }
     else
@@ -516,7 +1614,7 @@ bail:
     return result;
 }
 
-static int check_integrity(const uint8_t* digest)
+static int check_integrity(const uint8_t* digest, DigestType type)
 {
     if (!digest)
     {
@@ -525,15 +1623,31 @@ static int check_integrity(const uint8_t* digest)
     }
 
     uint8_t check[SHA256_DIGEST_SIZE];
-    sha256_finish(&sha, check);
+    uint32_t check_size = SHA256_DIGEST_SIZE;
+
+    if (type == DigestSha1)
+    {
+        if (!hash_sha1)
+        {
+            LOG("no SHA-1 state for the resumed pkg, skipping check");
+            return 1;
+        }
+        sha1_finish(&sha.sha1, check);
+        check_size = SHA1_DIGEST_SIZE;
+    }
+    else
+    {
+        sha256_finish(&sha.sha256, check);
+    }
 
-    LOG("checking integrity of pkg");
-    if (!pkgi_memequ(digest, check, SHA256_DIGEST_SIZE))
+    LOG("checking %s integrity of pkg", type == DigestSha1 ? "SHA-1" : "SHA-256");
+    if (!pkgi_memequ(digest, check, check_size))
     {
         LOG("pkg integrity is wrong, removing %s & resume data", item_path);
 
         pkgi_rm(item_path);
-        pkgi_rm(resume_file);
+        rm_file_atomic(resume_file);
+        rm_file_atomic(chunks_file);
 
         pkgi_dialog_error(_("pkg integrity failed, try downloading again"));
         return 0;
@@ -608,6 +1722,113 @@ static int create_rif(const char* contentid, const uint8_t* rap)
     return 1;
 }
 
+static int load_resume_data(void)
+{
+    union
+    {
+        resume_data resume;
+        resume_data_no_size resume_no_size;
+        resume_data_pkg_hash resume_pkg_hash;
+        resume_data_sha256 resume_sha256;
+        sha256_context legacy;
+    } data;
+
+    resume_chunks = 0;
+
+    int size = load_file_atomic(resume_file, &data, sizeof(data));
+    if (size == sizeof(data.resume))
+    {
+        resume_state = data.resume;
+        resume_chunks = data.resume.chunks;
+        resume_offset = data.resume.offset;
+        total_size = data.resume.total_size;
+        sha = data.resume.sha;
+        return 1;
+    }
+
+    if (size == sizeof(data.resume_no_size))
+    {
+        // total_size stays unknown, the chunk state is kept for restore_resumed_data
+        resume_state.offset = data.resume_no_size.offset;
+        resume_state.total_size = 0;
+        resume_state.chunks = data.resume_no_size.chunks;
+        resume_state.sha = data.resume_no_size.sha;
+        resume_state.chunk_sha = data.resume_no_size.chunk_sha;
+        resume_state.chunk_start_sha = data.resume_no_size.chunk_start_sha;
+        resume_chunks = data.resume_no_size.chunks;
+        resume_offset = data.resume_no_size.offset;
+        sha = data.resume_no_size.sha;
+        return 1;
+    }
+
+    if (size == sizeof(data.resume_pkg_hash))
+    {
+        resume_offset = data.resume_pkg_hash.offset;
+        sha = data.resume_pkg_hash.sha;
+        return 1;
+    }
+
+    if (size == sizeof(data.resume_sha256))
+    {
+        // the pkg is still verified if it has a SHA-256 digest
+        hash_starts();
+        resume_offset = data.resume_sha256.offset;
+        sha.sha256 = data.resume_sha256.sha;
+        hash_sha1 = 0;
+        return 1;
+    }
+
+    if (size == sizeof(data.legacy))
+    {
+        // resume files from older versions hold only the hash, their pkg was appended to
+        char path[256];
+        pkgi_snprintf(path, sizeof(path), "%s/%s", pkgi_get_temp_folder(), root);
+
+        int64_t file_size = pkgi_get_size(path);
+        if (file_size >= 0)
+        {
+            hash_starts();
+            resume_offset = file_size;
+            sha.sha256 = data.legacy;
+            hash_sha1 = 0;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void pkgi_download_init(void)
+{
+    if (!pkgi_mutex_create(&icon_fetch_lock, "icon_fetch_lock"))
+    {
+        LOG("cannot create icon fetch mutex");
+    }
+}
+
+void pkgi_download_configure(const Config* config)
+{
+    // 0 disables coalescing, otherwise round to the buffer alignment
+    write_buffer_size = (uint32_t)min64((uint64_t)config->write_buffer_kb * 1024, 16*1024*1024);
+    if (write_buffer_size)
+    {
+        write_buffer_size = max32(write_buffer_size, WRITE_BUFFER_ALIGN);
+        write_buffer_size -= write_buffer_size % WRITE_BUFFER_ALIGN;
+    }
+    LOG("write buffer size: %u bytes", write_buffer_size);
+
+    checkpoint_size = (uint64_t)config->checkpoint_mb * 1024 * 1024;
+    LOG("resume checkpoint every %llu bytes", checkpoint_size);
+
+    verify_chunks = config->verify_chunks;
+    retry_count = config->retry_count;
+
+    uint32_t global_rate = (uint32_t)min64((uint64_t)config->rate_limit_kb * 1024, UINT32_MAX);
+    uint32_t transfer_rate = (uint32_t)min64((uint64_t)config->transfer_limit_kb * 1024, UINT32_MAX);
+    pkgi_http_set_rate_limit(global_rate, transfer_rate, config->rate_limit_start, config->rate_limit_end);
+    chunk_manifest = config->chunk_manifest;
+}
+
 int pkgi_download(const DbItem* item, const int background_dl)
 {
     int result = 0;
@@ -616,9 +1837,12 @@ int pkgi_download(const DbItem* item, const int background_dl)
     LOG("package installation file: %s", root);
 
     pkgi_snprintf(resume_file, sizeof(resume_file), "%s/%s.resume", pkgi_get_temp_folder(), item->content);
-    if (pkgi_load(resume_file, &sha, sizeof(sha)) == sizeof(sha))
+    pkgi_snprintf(chunks_file, sizeof(chunks_file), "%s/%s.chunks", pkgi_get_temp_folder(), item->content);
+    hash_sha1 = item->digest && item->digest_type == DigestSha1;
+    total_size = 0;
+    if (load_resume_data())
     {
-        LOG("resume file exists, trying to resume");
+        LOG("resume file exists, trying to resume from %llu", resume_offset);
         pkgi_dialog_set_progress_title(_("Resuming..."));
         download_resume = 1;
     }
@@ -627,8 +1851,7 @@ int pkgi_download(const DbItem* item, const int background_dl)
         LOG("cannot load resume file, starting download from scratch");
         pkgi_dialog_set_progress_title(background_dl ? _("Adding background task...") : _("Downloading..."));
         download_resume = 0;
-        sha256_init(&sha);
-        sha256_starts(&sha, 0);
+        hash_starts();
     }
 
     http = NULL;
@@ -636,12 +1859,14 @@ int pkgi_download(const DbItem* item, const int background_dl)
     download_size = 0;
     download_offset = 0;
     initial_offset = 0;
+    disk_error = 0;
+    pkgi_queue_refresh();
     db_item = item;
 
     dialog_extra[0] = 0;
     dialog_eta[0] = 0;
-    info_start = pkgi_time_msec();
-    info_update = info_start + 1000;
+    pkgi_speed_reset(&download_speed, 0);
+    info_update = pkgi_time_msec() + 1000;
 
     if (item->rap)
     {
@@ -652,6 +1877,8 @@ int pkgi_download(const DbItem* item, const int background_dl)
     pkgi_dialog_update_progress(_("Downloading icon"), NULL, NULL, 1.f);
     if (!pkgi_download_icon(item->content)) goto finish;
 
+    select_mirrors();
+
     if (background_dl)
     {
         if (!queue_pkg_task()) goto finish;
@@ -659,10 +1886,11 @@ int pkgi_download(const DbItem* item, const int background_dl)
     else
     {
         if (!download_pkg_file()) goto finish;
-        if (!check_integrity(item->digest)) goto finish;
+        if (!check_integrity(item->digest, item->digest_type)) goto finish;
     }
 
-    pkgi_rm(resume_file);
+    rm_file_atomic(resume_file);
+    rm_file_atomic(chunks_file);
     result = 1;
 
 finish:
@@ -670,6 +1898,7 @@ finish:
     {
         pkgi_http_close(http);
     }
+    free_chunk_digests();
 
     return result;
 }
@@ -696,6 +1925,11 @@ int pkgi_install(const char *titleid)
 	// write - ICON_FILE
 	pkgi_snprintf(filename, sizeof(filename), "%s/ICON_FILE", pkg_path);
 	pkgi_snprintf(resume_file, sizeof(resume_file), "%s/%s.PNG", pkgi_get_temp_folder(), titleid);
+	if (pkgi_get_size(resume_file) <= 0)
+	{
+	    // the icon cache may have been trimmed while the pkg was downloading
+	    pkgi_download_icon(db_item->content);
+	}
 	if (rename(resume_file, filename) != 0)
 	{
 	    LOG("Error saving %s", filename);
@@ -714,7 +1948,7 @@ int pkgi_install(const char *titleid)
 	return (rename(pkg_path, filename) == 0);
 }
 
-int pkgi_download_icon(const char* content)
+static int download_icon(const char* content)
 {
     char icon_url[256];
     char icon_file[256];
@@ -741,20 +1975,31 @@ int pkgi_download_icon(const char* content)
     if (!buffer)
     {
         LOG("http request to %s failed", icon_url);
-        return pkgi_save(icon_file, iconfile_data, iconfile_data_size);
+        return save_file_atomic(icon_file, iconfile_data, iconfile_data_size);
     }
 
     if (!sz)
     {
         LOG("icon not found, using default");
         free(buffer);
-        return pkgi_save(icon_file, iconfile_data, iconfile_data_size);
+        return save_file_atomic(icon_file, iconfile_data, iconfile_data_size);
     }
 
     LOG("received %u bytes", sz);
 
-    pkgi_save(icon_file, buffer, sz);
+    // the icon thread may load it at any time, never expose a partial file
+    int saved = save_file_atomic(icon_file, buffer, sz);
     free(buffer);
 
-    return 1;
+    return saved;
+}
+
+// the icon thread and the download thread may want the same icon, which is saved through the same temp file
+int pkgi_download_icon(const char* content)
+{
+    pkgi_mutex_lock(icon_fetch_lock);
+    int result = download_icon(content);
+    pkgi_mutex_unlock(icon_fetch_lock);
+
+    return result;
 }
@@ -0,0 +1,419 @@
+#include "pkgi_icon.h"
+#include "pkgi_download.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#define ICON_PENDING_SIZE 16
+#define ICON_READY_SIZE 8
+#define ICON_DISK_FILES 512
+#define ICON_SEM_MAX 1024
+
+typedef struct {
+    char titleid[10];
+    pkgi_texture texture;
+    uint32_t used;
+} icon_entry;
+
+typedef struct {
+    char titleid[10];
+    int thumb;
+} icon_request;
+
+// decoded thumbnail waiting for the main thread to copy it into the atlas
+typedef struct {
+    char titleid[10];
+    uint32_t pixels[PKGI_THUMB_WIDTH * PKGI_THUMB_HEIGHT];
+} icon_ready;
+
+typedef struct {
+    char titleid[10];
+    uint32_t used;
+} thumb_entry;
+
+typedef struct {
+    char name[16];
+    uint32_t size;
+    time_t mtime;
+} icon_file;
+
+static icon_entry icon_cache[PKGI_ICON_CACHE_SIZE];
+static uint32_t icon_clock;
+static thumb_entry thumb_cache[PKGI_THUMB_SLOTS];
+
+// pending requests, newest at the end, guarded by icon_lock
+static icon_request icon_pending[ICON_PENDING_SIZE];
+static uint32_t icon_pending_count;
+static char icon_fetching[10];
+static icon_ready icon_ready_list[ICON_READY_SIZE];
+static uint32_t icon_ready_count;
+static pkgi_mutex icon_lock;
+static pkgi_sem icon_sem;
+static pkgi_sem icon_done;
+static int icon_running;
+static volatile int icon_stop;
+
+// used only by the worker thread
+static icon_file icon_files[ICON_DISK_FILES];
+static uint32_t icon_pixels[PKGI_THUMB_WIDTH * PKGI_THUMB_HEIGHT];
+
+static void get_titleid(char* titleid, const char* content)
+{
+    pkgi_memcpy(titleid, content + 7, 9);
+    titleid[9] = 0;
+}
+
+static int find_pending(const char* titleid)
+{
+    for (uint32_t i = 0; i < icon_pending_count; i++)
+    {
+        if (pkgi_stricmp(icon_pending[i].titleid, titleid) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int find_ready(const char* titleid)
+{
+    for (uint32_t i = 0; i < icon_ready_count; i++)
+    {
+        if (pkgi_stricmp(icon_ready_list[i].titleid, titleid) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int pop_pending(icon_request* request)
+{
+    int found = 0;
+
+    pkgi_mutex_lock(icon_lock);
+    if (icon_pending_count)
+    {
+        *request = icon_pending[--icon_pending_count];
+        pkgi_strncpy(icon_fetching, sizeof(icon_fetching), request->titleid);
+        found = 1;
+    }
+    pkgi_mutex_unlock(icon_lock);
+
+    return found;
+}
+
+static int compare_mtime(const void* a, const void* b)
+{
+    const icon_file* fa = a;
+    const icon_file* fb = b;
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+// deletes the oldest icons until the cache fits in PKGI_ICON_DISK_MB
+static void trim_disk_cache(void)
+{
+    char path[256];
+    struct stat st;
+    struct dirent* dir;
+    uint64_t total = 0;
+    uint32_t count = 0;
+
+    DIR* d = opendir(PKGI_TMP_FOLDER);
+    if (!d)
+    {
+        return;
+    }
+
+    while ((dir = readdir(d)) != NULL && count < ICON_DISK_FILES)
+    {
+        uint32_t len = pkgi_strlen(dir->d_name);
+        if (len != 13 || pkgi_stricmp(dir->d_name + 9, ".PNG") != 0)
+        {
+            continue;
+        }
+
+        pkgi_snprintf(path, sizeof(path), PKGI_TMP_FOLDER "/%s", dir->d_name);
+        if (stat(path, &st) != 0)
+        {
+            continue;
+        }
+
+        pkgi_strncpy(icon_files[count].name, sizeof(icon_files[count].name), dir->d_name);
+        icon_files[count].size = st.st_size;
+        icon_files[count].mtime = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    if (total <= PKGI_ICON_DISK_MB * 1024 * 1024)
+    {
+        return;
+    }
+
+    qsort(icon_files, count, sizeof(icon_file), &compare_mtime);
+    for (uint32_t i = 0; i < count && total > PKGI_ICON_DISK_MB * 1024 * 1024; i++)
+    {
+        pkgi_snprintf(path, sizeof(path), PKGI_TMP_FOLDER "/%s", icon_files[i].name);
+        pkgi_rm(path);
+        total -= icon_files[i].size;
+    }
+    LOG("icon cache trimmed to %llu bytes", total);
+}
+
+// a thumbnail that cannot be decoded stays blank, so it is not requested again
+static void decode_thumb(const char* titleid, const char* path)
+{
+    if (!pkgi_load_png_thumb(path, icon_pixels))
+    {
+        memset(icon_pixels, 0, sizeof(icon_pixels));
+    }
+
+    pkgi_mutex_lock(icon_lock);
+    if (icon_ready_count < ICON_READY_SIZE)
+    {
+        icon_ready* ready = &icon_ready_list[icon_ready_count++];
+        pkgi_strncpy(ready->titleid, sizeof(ready->titleid), titleid);
+        pkgi_memcpy(ready->pixels, icon_pixels, sizeof(icon_pixels));
+    }
+    pkgi_mutex_unlock(icon_lock);
+}
+
+static void icon_thread(void)
+{
+    icon_request request;
+    char content[20];
+    char path[256];
+    int fetched = 0;
+
+    LOG("icon thread start");
+    trim_disk_cache();
+
+    while (!icon_stop)
+    {
+        pkgi_sem_wait(icon_sem);
+
+        while (!icon_stop && pop_pending(&request))
+        {
+            pkgi_snprintf(path, sizeof(path), PKGI_TMP_FOLDER "/%s.PNG", request.titleid);
+            if (pkgi_get_size(path) <= 0)
+            {
+                // pkgi_download_icon only looks at the title id part of the content id
+                pkgi_snprintf(content, sizeof(content), "XXXXXX-%s", request.titleid);
+                pkgi_download_icon(content);
+                fetched++;
+            }
+
+            if (request.thumb)
+            {
+                decode_thumb(request.titleid, path);
+            }
+
+            pkgi_mutex_lock(icon_lock);
+            icon_fetching[0] = 0;
+            pkgi_mutex_unlock(icon_lock);
+        }
+
+        if (fetched && !icon_pending_count)
+        {
+            trim_disk_cache();
+            fetched = 0;
+        }
+    }
+
+    LOG("icon thread stop");
+    pkgi_sem_post(icon_done);
+    pkgi_thread_exit();
+}
+
+void pkgi_icon_init(void)
+{
+    icon_stop = 0;
+    icon_running = 0;
+    icon_pending_count = 0;
+    icon_fetching[0] = 0;
+
+    if (!pkgi_mutex_create(&icon_lock, "icon_lock") || !pkgi_sem_create(&icon_sem, 0, ICON_SEM_MAX) || !pkgi_sem_create(&icon_done, 0, 1))
+    {
+        LOG("cannot create icon thread locks");
+        return;
+    }
+
+    icon_running = pkgi_start_thread("icon_thread", &icon_thread);
+}
+
+void pkgi_icon_end(void)
+{
+    icon_stop = 1;
+
+    // the worker may still be writing a thumbnail or an icon file, wait until it is gone
+    if (icon_running)
+    {
+        pkgi_sem_post(icon_sem);
+        pkgi_sem_wait(icon_done);
+        icon_running = 0;
+    }
+
+    for (uint32_t i = 0; i < PKGI_ICON_CACHE_SIZE; i++)
+    {
+        if (icon_cache[i].texture)
+        {
+            pkgi_free_texture(icon_cache[i].texture);
+            icon_cache[i].texture = NULL;
+        }
+    }
+}
+
+static void add_request(const char* content, int thumb)
+{
+    icon_request request;
+    get_titleid(request.titleid, content);
+    request.thumb = thumb;
+
+    pkgi_mutex_lock(icon_lock);
+    int index = find_pending(request.titleid);
+    if (index >= 0)
+    {
+        // move it to the front of the line
+        request.thumb |= icon_pending[index].thumb;
+        icon_pending_count--;
+        pkgi_memmove(&icon_pending[index], &icon_pending[index + 1], (icon_pending_count - index) * sizeof(icon_request));
+    }
+    else if (icon_pending_count == ICON_PENDING_SIZE)
+    {
+        // cursor moved on, the oldest request is the least interesting
+        icon_pending_count--;
+        pkgi_memmove(&icon_pending[0], &icon_pending[1], icon_pending_count * sizeof(icon_request));
+    }
+    icon_pending[icon_pending_count++] = request;
+    pkgi_mutex_unlock(icon_lock);
+
+    if (index < 0)
+    {
+        pkgi_sem_post(icon_sem);
+    }
+}
+
+void pkgi_icon_request(const char* content)
+{
+    add_request(content, 0);
+}
+
+pkgi_texture pkgi_icon_get(const char* content)
+{
+    char titleid[10];
+    char path[256];
+    icon_entry* slot = &icon_cache[0];
+
+    get_titleid(titleid, content);
+    for (uint32_t i = 0; i < PKGI_ICON_CACHE_SIZE; i++)
+    {
+        icon_entry* entry = &icon_cache[i];
+        if (entry->texture && pkgi_stricmp(entry->titleid, titleid) == 0)
+        {
+            entry->used = ++icon_clock;
+            return entry->texture;
+        }
+
+        if (!entry->texture || (slot->texture && entry->used < slot->used))
+        {
+            slot = entry;
+        }
+    }
+
+    pkgi_mutex_lock(icon_lock);
+    int busy = find_pending(titleid) >= 0 || pkgi_stricmp(icon_fetching, titleid) == 0;
+    pkgi_mutex_unlock(icon_lock);
+    if (busy)
+    {
+        return NULL;
+    }
+
+    pkgi_snprintf(path, sizeof(path), PKGI_TMP_FOLDER "/%s.PNG", titleid);
+    if (pkgi_get_size(path) <= 0)
+    {
+        pkgi_icon_request(content);
+        return NULL;
+    }
+
+    pkgi_texture texture = pkgi_load_png_file(path);
+    if (!texture)
+    {
+        return NULL;
+    }
+
+    if (slot->texture)
+    {
+        pkgi_free_texture(slot->texture);
+    }
+    pkgi_strncpy(slot->titleid, sizeof(slot->titleid), titleid);
+    slot->texture = texture;
+    slot->used = ++icon_clock;
+
+    return texture;
+}
+
+void pkgi_icon_update(void)
+{
+    pkgi_mutex_lock(icon_lock);
+    for (uint32_t i = 0; i < icon_ready_count; i++)
+    {
+        thumb_entry* slot = &thumb_cache[0];
+        for (uint32_t k = 1; k < PKGI_THUMB_SLOTS && slot->used; k++)
+        {
+            if (thumb_cache[k].used < slot->used)
+            {
+                slot = &thumb_cache[k];
+            }
+        }
+
+        pkgi_thumb_upload((uint32_t)(slot - thumb_cache), icon_ready_list[i].pixels);
+        pkgi_strncpy(slot->titleid, sizeof(slot->titleid), icon_ready_list[i].titleid);
+        slot->used = ++icon_clock;
+    }
+    icon_ready_count = 0;
+    pkgi_mutex_unlock(icon_lock);
+}
+
+int pkgi_icon_pending(void)
+{
+    pkgi_mutex_lock(icon_lock);
+    int pending = icon_ready_count != 0;
+    pkgi_mutex_unlock(icon_lock);
+
+    return pending;
+}
+
+int pkgi_icon_thumb(const char* content)
+{
+    char titleid[10];
+    get_titleid(titleid, content);
+
+    for (uint32_t i = 0; i < PKGI_THUMB_SLOTS; i++)
+    {
+        if (thumb_cache[i].used && pkgi_stricmp(thumb_cache[i].titleid, titleid) == 0)
+        {
+            thumb_cache[i].used = ++icon_clock;
+            return i;
+        }
+    }
+
+    pkgi_mutex_lock(icon_lock);
+    int busy = find_ready(titleid) >= 0 || pkgi_stricmp(icon_fetching, titleid) == 0;
+    int index = find_pending(titleid);
+    if (index >= 0)
+    {
+        icon_pending[index].thumb = 1;
+        busy = 1;
+    }
+    pkgi_mutex_unlock(icon_lock);
+
+    if (!busy)
+    {
+        add_request(content, 1);
+    }
+    return -1;
+}
@@ -23,6 +23,7 @@ typedef enum {
     MenuSort,
     MenuFilter,
     MenuRefresh,
+    MenuScanUpdates,
     MenuMode,
     MenuUpdate,
     MenuMusic,
@@ -61,6 +62,7 @@ static MenuEntry menu_entries[] =
     { MenuUpdate, "Updates", 1 },
 
     { MenuRefresh, "Refresh...", 0 },
+    { MenuScanUpdates, "Scan updates...", 0 },
 };
 
 static MenuEntry content_entries[] = 
@@ -127,6 +129,7 @@ void pkgi_menu_start(int search_clear, const Config* config)
     menu_entries[16].text = _("Music");
     menu_entries[17].text = _("Updates");
     menu_entries[18].text = _("Refresh...");
+    menu_entries[19].text = _("Scan updates...");
 
     content_entries[0].text = _("All");
     content_entries[1].text = _("Games");
@@ -238,6 +241,12 @@ int pkgi_do_menu(pkgi_input* input)
             menu_delta = -1;
             return 1;
         }
+        else if (type == MenuScanUpdates)
+        {
+            menu_result = MenuResultScanUpdates;
+            menu_delta = -1;
+            return 1;
+        }
         else if (type == MenuSort)
         {
             DbSort value = (DbSort)menu_entries[menu_selected].value;
@@ -307,11 +316,15 @@ int pkgi_do_menu(pkgi_input* input)
             }
             y += font_height;
         }
+        else if (type == MenuScanUpdates && !menu_allow_refresh)
+        {
+            y += font_height;
+        }
 
         int x = VITA_WIDTH - (pkgi_menu_width + PKGI_MAIN_HMARGIN) + PKGI_MENU_LEFT_PADDING;
 
         char text[64];
-        if (type == MenuSearch || type == MenuSearchClear || type == MenuText || type == MenuRefresh)
+        if (type == MenuSearch || type == MenuSearchClear || type == MenuText || type == MenuRefresh || type == MenuScanUpdates)
         {
             pkgi_strncpy(text, sizeof(text), entry->text);
         }
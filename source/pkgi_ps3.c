@@ -1,9 +1,12 @@
 #include "pkgi.h"
 #include "pkgi_style.h"
+#include "pkgi_utils.h"
+#include "pkgi_download.h"
 
 #include <sys/stat.h>
 #include <sys/thread.h>
 #include <sys/mutex.h>
+#include <sys/sem.h>
 #include <sys/memory.h>
 #include <sys/process.h>
 #include <sysutil/osk.h>
@@ -15,9 +18,12 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <ya2d/ya2d.h>
+#include <pngdec/pngdec.h>
 #include <curl/curl.h>
 
 #include "ttf_render.h"
@@ -42,7 +48,19 @@
 #define ANALOG_MAX          (ANALOG_CENTER + ANALOG_THRESHOLD)
 
 #define PKGI_USER_AGENT "Mozilla/5.0 (PLAYSTATION 3; 1.00)"
+#define PKGI_HTTP_POOL_SIZE 8
 
+#define THUMB_ATLAS_WIDTH   (PKGI_THUMB_WIDTH * PKGI_THUMB_COLUMNS)
+#define THUMB_ATLAS_HEIGHT  (PKGI_THUMB_HEIGHT * PKGI_THUMB_COLUMNS)
+
+
+// token bucket, tokens are bytes that can be received right now
+typedef struct
+{
+    uint32_t rate;      // bytes per second, 0 is unlimited
+    int64_t tokens;
+    uint32_t updated;
+} rate_bucket;
 
 struct pkgi_http
 {
@@ -50,6 +68,13 @@ struct pkgi_http
     uint64_t size;
     uint64_t offset;
     CURL *curl;
+    curl_write_callback write_func;
+    curl_xferinfo_callback xferinfo_func;
+    pkgi_http_length_func* length_func;
+    int length_checked;
+    CURLcode result;
+    rate_bucket rate;
+    int paused;
 };
 
 typedef struct 
@@ -62,8 +87,13 @@ typedef struct
 
 typedef struct
 {
+    CURL *curl;
     char *memory;
     size_t size;
+    size_t capacity;
+    int length_checked;
+    char etag[64];
+    struct curl_slist *headers;
 } curl_memory_t;
 
 
@@ -89,8 +119,18 @@ static uint16_t g_ime_title[SCE_IME_DIALOG_MAX_TITLE_LENGTH];
 static uint16_t g_ime_text[SCE_IME_DIALOG_MAX_TEXT_LENGTH];
 static uint16_t g_ime_input[SCE_IME_DIALOG_MAX_TEXT_LENGTH + 1];
 
-static pkgi_http g_http[4];
+static pkgi_http g_http[PKGI_HTTP_POOL_SIZE];
+static sys_mutex_t g_http_lock;
+static CURLSH *g_curl_share;
+static sys_mutex_t g_curl_share_lock[CURL_LOCK_DATA_LAST];
+static rate_bucket g_rate;
+static sys_mutex_t g_rate_lock;
+static uint32_t g_transfer_rate;
+static int g_rate_start_hour;
+static int g_rate_end_hour;
 static t_tex_buttons tex_buttons;
+static u32* thumb_atlas;
+static u32 thumb_atlas_offset;
 
 static MREADER *mem_reader;
 static MODULE *module;
@@ -282,6 +322,22 @@ static int sys_game_get_temperature(int sel, u32 *temperature)
     return_to_user_prog(int);
 }
 
+static int create_mutex(sys_mutex_t* mutex, const char* name)
+{
+    sys_mutex_attr_t mutex_attr;
+    mutex_attr.attr_protocol = SYS_MUTEX_PROTOCOL_FIFO;
+    mutex_attr.attr_recursive = SYS_MUTEX_ATTR_NOT_RECURSIVE;
+    mutex_attr.attr_pshared = SYS_MUTEX_ATTR_NOT_PSHARED;
+    mutex_attr.attr_adaptive = SYS_MUTEX_ATTR_ADAPTIVE;
+    strncpy(mutex_attr.name, name, sizeof(mutex_attr.name));
+
+    int ret = sysMutexCreate(mutex, &mutex_attr);
+    if (ret != 0) {
+        LOG("mutex create error (%x)", ret);
+    }
+    return ret;
+}
+
 int pkgi_dialog_lock(void)
 {
     int res = sysMutexLock(g_dialog_lock, 0);
@@ -542,6 +598,11 @@ error_end:
     osk_level = 0;
 }
 
+int pkgi_dialog_input_active(void)
+{
+    return g_ime_active;
+}
+
 int pkgi_dialog_input_update(void)
 {
     if (!g_ime_active)
@@ -611,6 +672,15 @@ void load_ttf_fonts()
 	ya2d_texturePointer = (u32*) init_ttf_table((u16*) ya2d_texturePointer);
 }
 
+static void init_thumb_atlas(void)
+{
+    // texture memory is carved from ya2d's pool the same way as the ttf glyph table
+    thumb_atlas = (u32*) (((uintptr_t) ya2d_texturePointer + 15) & ~15);
+    ya2d_texturePointer = thumb_atlas + THUMB_ATLAS_WIDTH * THUMB_ATLAS_HEIGHT;
+    thumb_atlas_offset = tiny3d_TextureOffset(thumb_atlas);
+    memset(thumb_atlas, 0, THUMB_ATLAS_WIDTH * THUMB_ATLAS_HEIGHT * sizeof(u32));
+}
+
 static void sys_callback(uint64_t status, uint64_t param, void* userdata)
 {
     switch (status) {
@@ -628,6 +698,66 @@ static void sys_callback(uint64_t status, uint64_t param, void* userdata)
     }
 }
 
+static void curl_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    sysMutexLock(g_curl_share_lock[data], 0);
+}
+
+static void curl_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    sysMutexUnlock(g_curl_share_lock[data]);
+}
+
+// DNS and TLS sessions are shared by every handle; connections stay warm inside
+// the pooled easy handles, as libcurl can't share its connection cache across threads
+static void pkgi_curl_share_init(void)
+{
+    create_mutex(&g_http_lock, "http");
+    create_mutex(&g_rate_lock, "rate");
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        create_mutex(&g_curl_share_lock[i], "curlshr");
+    }
+
+    g_curl_share = curl_share_init();
+    if (!g_curl_share)
+    {
+        LOG("curl share init error");
+        return;
+    }
+
+    curl_share_setopt(g_curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+    curl_share_setopt(g_curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+    curl_share_setopt(g_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void pkgi_curl_share_end(void)
+{
+    for (int i = 0; i < PKGI_HTTP_POOL_SIZE; i++)
+    {
+        if (g_http[i].curl)
+        {
+            curl_easy_cleanup(g_http[i].curl);
+            g_http[i].curl = NULL;
+        }
+    }
+
+    if (g_curl_share)
+    {
+        curl_share_cleanup(g_curl_share);
+        g_curl_share = NULL;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        sysMutexDestroy(g_curl_share_lock[i]);
+    }
+    sysMutexDestroy(g_http_lock);
+    sysMutexDestroy(g_rate_lock);
+}
+
 void pkgi_start(void)
 {
     pkgi_start_debug_log();
@@ -638,18 +768,10 @@ void pkgi_start(void)
     sysModuleLoad(SYSMODULE_NET);
     curl_global_init(CURL_GLOBAL_ALL);
 
-    sys_mutex_attr_t mutex_attr;
-    mutex_attr.attr_protocol = SYS_MUTEX_PROTOCOL_FIFO;
-    mutex_attr.attr_recursive = SYS_MUTEX_ATTR_NOT_RECURSIVE;
-    mutex_attr.attr_pshared = SYS_MUTEX_ATTR_NOT_PSHARED;
-    mutex_attr.attr_adaptive = SYS_MUTEX_ATTR_ADAPTIVE;
-    strcpy(mutex_attr.name, "dialog");
-
-    int ret = sysMutexCreate(&g_dialog_lock, &mutex_attr);
-    if (ret != 0) {
-        LOG("mutex create error (%x)", ret);
-    }
+    create_mutex(&g_dialog_lock, "dialog");
+    pkgi_curl_share_init();
 
+    int ret;
     sysUtilGetSystemParamInt(SYSUTIL_SYSTEMPARAM_ID_ENTER_BUTTON_ASSIGN, &ret);
     if (ret == 0)
     {
@@ -676,6 +798,7 @@ void pkgi_start(void)
     SetFontZ(PKGI_FONT_Z);
 
     load_ttf_fonts();
+    init_thumb_atlas();
 
     pkgi_mkdirs(PKGI_TMP_FOLDER);
     pkgi_mkdirs(PKGI_RAP_FOLDER);
@@ -730,10 +853,6 @@ int pkgi_update(pkgi_input* input)
     }
 #endif
 
-	ya2d_screenClear();
-	ya2d_screenBeginDrawing();
-	reset_ttf_frame();
-
     uint64_t time = pkgi_time_msec();
     input->delta = time - g_time;
     g_time = time;
@@ -741,6 +860,20 @@ int pkgi_update(pkgi_input* input)
     return 1;
 }
 
+void pkgi_start_frame(void)
+{
+	ya2d_screenClear();
+	ya2d_screenBeginDrawing();
+	reset_ttf_frame();
+}
+
+void pkgi_idle_frame(void)
+{
+    // nothing is flipped, system callbacks still need to run and input is still polled at the display rate
+    sysUtilCheckCallback();
+    usleep(1000000 / 60);
+}
+
 void pkgi_swap(void)
 {
 	ya2d_screenFlip();
@@ -750,6 +883,7 @@ void pkgi_end(void)
 {
     if (module) end_music();
 
+    pkgi_curl_share_end();
     curl_global_cleanup();
     pkgi_stop_debug_log();
 
@@ -824,6 +958,12 @@ int pkgi_is_incomplete(const char* titleid)
 
     struct stat st;
     int res = stat(path, &st);
+    if (res != 0)
+    {
+        // the resume file may be between its removal and the rename of its replacement
+        pkgi_snprintf(path, sizeof(path), "%s/%s.resume.tmp", pkgi_get_temp_folder(), titleid);
+        res = stat(path, &st);
+    }
     return (res == 0);
 }
 
@@ -841,7 +981,7 @@ int pkgi_dir_exists(const char* path)
 int pkgi_is_installed(const char* content)
 {    
     char path[128];
-    snprintf(path, sizeof(path), "/dev_hdd0/game/%.9s", content + 7);
+    snprintf(path, sizeof(path), PKGI_GAME_FOLDER "/%.9s", content + 7);
 
     return (pkgi_dir_exists(path));
 }
@@ -856,7 +996,7 @@ void pkgi_thread_exit()
 	sysThreadExit(0);
 }
 
-void pkgi_start_thread(const char* name, pkgi_thread_entry* start)
+int pkgi_start_thread(const char* name, pkgi_thread_entry* start)
 {
 	s32 ret;
 	sys_ppu_thread_t id;
@@ -868,6 +1008,7 @@ void pkgi_start_thread(const char* name, pkgi_thread_entry* start)
     {
         LOG("failed to start %s thread", name);
     }
+    return (ret == 0);
 }
 
 void pkgi_sleep(uint32_t msec)
@@ -875,6 +1016,57 @@ void pkgi_sleep(uint32_t msec)
     usleep(msec * 1000);
 }
 
+int pkgi_sem_create(pkgi_sem* sem, uint32_t count, uint32_t max)
+{
+    sys_sem_attr_t sem_attr;
+    memset(&sem_attr, 0, sizeof(sem_attr));
+    sem_attr.attr_protocol = SYS_SEM_ATTR_PROTOCOL;
+    sem_attr.attr_pshared = SYS_SEM_ATTR_PSHARED;
+    strcpy(sem_attr.name, "pkgisem");
+
+    int ret = sysSemCreate((sys_sem_t*) sem, &sem_attr, count, max);
+    if (ret != 0)
+    {
+        LOG("semaphore create error (%x)", ret);
+    }
+    return (ret == 0);
+}
+
+void pkgi_sem_wait(pkgi_sem sem)
+{
+    sysSemWait((sys_sem_t) sem, 0);
+}
+
+void pkgi_sem_post(pkgi_sem sem)
+{
+    sysSemPost((sys_sem_t) sem, 1);
+}
+
+void pkgi_sem_destroy(pkgi_sem sem)
+{
+    sysSemDestroy((sys_sem_t) sem);
+}
+
+int pkgi_mutex_create(pkgi_mutex* mutex, const char* name)
+{
+    return (create_mutex((sys_mutex_t*) mutex, name) == 0);
+}
+
+void pkgi_mutex_lock(pkgi_mutex mutex)
+{
+    sysMutexLock((sys_mutex_t) mutex, 0);
+}
+
+void pkgi_mutex_unlock(pkgi_mutex mutex)
+{
+    sysMutexUnlock((sys_mutex_t) mutex);
+}
+
+void pkgi_mutex_destroy(pkgi_mutex mutex)
+{
+    sysMutexDestroy((sys_mutex_t) mutex);
+}
+
 int pkgi_load(const char* name, void* data, uint32_t max)
 {
     FILE* fd = fopen(name, "rb");
@@ -1014,6 +1206,92 @@ void pkgi_free_texture(pkgi_texture texture)
     ya2d_freeTexture((ya2d_Texture*) texture);
 }
 
+int pkgi_load_png_thumb(const char* filename, uint32_t* pixels)
+{
+    pngData png;
+
+    if (pngLoadFromFile(filename, &png) != 0 || !png.bmp_out)
+    {
+        LOG("failed to decode %s", filename);
+        return 0;
+    }
+
+    // box filter, every thumbnail pixel averages the source pixels it covers
+    for (uint32_t y = 0; y < PKGI_THUMB_HEIGHT; y++)
+    {
+        uint32_t y0 = y * png.height / PKGI_THUMB_HEIGHT;
+        uint32_t y1 = max32((y + 1) * png.height / PKGI_THUMB_HEIGHT, y0 + 1);
+
+        for (uint32_t x = 0; x < PKGI_THUMB_WIDTH; x++)
+        {
+            uint32_t x0 = x * png.width / PKGI_THUMB_WIDTH;
+            uint32_t x1 = max32((x + 1) * png.width / PKGI_THUMB_WIDTH, x0 + 1);
+            uint32_t sum[4] = { 0, 0, 0, 0 };
+
+            for (uint32_t sy = y0; sy < y1; sy++)
+            {
+                const u32* row = (const u32*) ((const u8*) png.bmp_out + sy * png.pitch);
+                for (uint32_t sx = x0; sx < x1; sx++)
+                {
+                    for (int c = 0; c < 4; c++)
+                    {
+                        sum[c] += byte32(row[sx], c);
+                    }
+                }
+            }
+
+            uint32_t count = (y1 - y0) * (x1 - x0);
+            pixels[y * PKGI_THUMB_WIDTH + x] = (sum[3] / count) << 24 | (sum[2] / count) << 16 | (sum[1] / count) << 8 | (sum[0] / count);
+        }
+    }
+
+    free(png.bmp_out);
+    return 1;
+}
+
+void pkgi_thumb_upload(uint32_t slot, const uint32_t* pixels)
+{
+    u32* cell = thumb_atlas + (slot / PKGI_THUMB_COLUMNS) * PKGI_THUMB_HEIGHT * THUMB_ATLAS_WIDTH + (slot % PKGI_THUMB_COLUMNS) * PKGI_THUMB_WIDTH;
+
+    for (uint32_t y = 0; y < PKGI_THUMB_HEIGHT; y++)
+    {
+        memcpy(cell + y * THUMB_ATLAS_WIDTH, pixels + y * PKGI_THUMB_WIDTH, PKGI_THUMB_WIDTH * sizeof(u32));
+    }
+}
+
+void pkgi_thumb_begin(void)
+{
+    tiny3d_SetTextureWrap(0, thumb_atlas_offset, THUMB_ATLAS_WIDTH, THUMB_ATLAS_HEIGHT, THUMB_ATLAS_WIDTH * sizeof(u32),
+        TINY3D_TEX_FORMAT_A8R8G8B8, TEXTWRAP_CLAMP, TEXTWRAP_CLAMP, TEXTURE_LINEAR);
+    tiny3d_SetPolygon(TINY3D_QUADS);
+}
+
+void pkgi_draw_thumb(uint32_t slot, int x, int y, int z, int w, int h)
+{
+    // half a texel inset keeps linear filtering from bleeding into the next cell
+    float u0 = ((slot % PKGI_THUMB_COLUMNS) * PKGI_THUMB_WIDTH + 0.5f) / THUMB_ATLAS_WIDTH;
+    float v0 = ((slot / PKGI_THUMB_COLUMNS) * PKGI_THUMB_HEIGHT + 0.5f) / THUMB_ATLAS_HEIGHT;
+    float u1 = u0 + (PKGI_THUMB_WIDTH - 1.f) / THUMB_ATLAS_WIDTH;
+    float v1 = v0 + (PKGI_THUMB_HEIGHT - 1.f) / THUMB_ATLAS_HEIGHT;
+
+    tiny3d_VertexPos(x    , y    , z);
+    tiny3d_VertexColor(0xffffffff);
+    tiny3d_VertexTexture(u0, v0);
+
+    tiny3d_VertexPos(x + w, y    , z);
+    tiny3d_VertexTexture(u1, v0);
+
+    tiny3d_VertexPos(x + w, y + h, z);
+    tiny3d_VertexTexture(u1, v1);
+
+    tiny3d_VertexPos(x    , y + h, z);
+    tiny3d_VertexTexture(u0, v1);
+}
+
+void pkgi_thumb_end(void)
+{
+    tiny3d_End();
+}
 
 void pkgi_clip_set(int x, int y, int w, int h)
 {
@@ -1094,7 +1372,7 @@ void pkgi_draw_text_ttf(int x, int y, int z, uint32_t color, const char* text)
 
 int pkgi_text_width_ttf(const char* text)
 {
-    return (display_ttf_string(0, 0, text, 0, 0, PKGI_FONT_WIDTH+6, PKGI_FONT_HEIGHT+2));
+    return (width_ttf_string(text, PKGI_FONT_WIDTH+6, PKGI_FONT_HEIGHT+2));
 }
 
 
@@ -1140,6 +1418,9 @@ void pkgi_curl_init(CURL *curl)
     curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
     // Set timeout for the connection to build
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 20L);
+    // abort stalled transfers (less than 1 byte/s for 60 seconds), so they can be retried
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
     // Follow redirects
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
     // maximum number of redirects allowed
@@ -1148,27 +1429,30 @@ void pkgi_curl_init(CURL *curl)
     curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
     // request using SSL for the FTP transfer if available
     curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
-}
-
-pkgi_http* pkgi_http_get(const char* url, const char* content, uint64_t offset)
-{
-    LOG("http get");
-
-    if (!pkgi_validate_url(url))
+    // share DNS cache and TLS sessions with the other pooled handles
+    if (g_curl_share)
     {
-        LOG("unsupported URL (%s)", url);
-        return NULL;
+        curl_easy_setopt(curl, CURLOPT_SHARE, g_curl_share);
     }
+}
 
+// takes a free handle from the pool; handles are reset, not destroyed, on release
+// so their open connections can be reused by the next request to the same host
+static pkgi_http* pkgi_http_acquire(const char* url)
+{
     pkgi_http* http = NULL;
-    for (size_t i = 0; i < 4; i++)
+
+    sysMutexLock(g_http_lock, 0);
+    for (size_t i = 0; i < PKGI_HTTP_POOL_SIZE; i++)
     {
         if (g_http[i].used == 0)
         {
             http = &g_http[i];
+            http->used = 1;
             break;
         }
     }
+    sysMutexUnlock(g_http_lock);
 
     if (!http)
     {
@@ -1176,18 +1460,54 @@ pkgi_http* pkgi_http_get(const char* url, const char* content, uint64_t offset)
         return NULL;
     }
 
-    http->curl = curl_easy_init();
+    if (http->curl)
+    {
+        curl_easy_reset(http->curl);
+    }
+    else
+    {
+        http->curl = curl_easy_init();
+    }
+
     if (!http->curl)
     {
         LOG("curl init error");
+        http->used = 0;
         return NULL;
     }
 
     pkgi_curl_init(http->curl);
     curl_easy_setopt(http->curl, CURLOPT_URL, url);
 
+    return http;
+}
+
+static void pkgi_http_release(pkgi_http* http)
+{
+    sysMutexLock(g_http_lock, 0);
+    http->used = 0;
+    sysMutexUnlock(g_http_lock);
+}
+
+pkgi_http* pkgi_http_get(const char* url, const char* content, uint64_t offset)
+{
+    LOG("http get");
+
+    if (!pkgi_validate_url(url))
+    {
+        LOG("unsupported URL (%s)", url);
+        return NULL;
+    }
+
+    pkgi_http* http = pkgi_http_acquire(url);
+    if (!http)
+    {
+        return NULL;
+    }
+
     LOG("starting http GET request for %s", url);
 
+    http->offset = offset;
     if (offset != 0)
     {
         LOG("setting http offset %ld", offset);
@@ -1195,10 +1515,26 @@ pkgi_http* pkgi_http_get(const char* url, const char* content, uint64_t offset)
         curl_easy_setopt(http->curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) offset);
     }
 
-    http->used = 1;
     return(http);
 }
 
+pkgi_http* pkgi_http_get_range(const char* url, uint64_t offset, uint64_t size)
+{
+    pkgi_http* http = pkgi_http_get(url, NULL, 0);
+    if (!http)
+    {
+        return NULL;
+    }
+
+    char range[64];
+    pkgi_snprintf(range, sizeof(range), "%llu-%llu", offset, offset + size - 1);
+    LOG("setting http range %s", range);
+    curl_easy_setopt(http->curl, CURLOPT_RANGE, range);
+    http->offset = offset;
+
+    return http;
+}
+
 int pkgi_http_response_length(pkgi_http* http, int64_t* length)
 {
     CURLcode res;
@@ -1227,42 +1563,230 @@ int pkgi_http_response_length(pkgi_http* http, int64_t* length)
     return 1;
 }
 
-int pkgi_http_read(pkgi_http* http, void* write_func, void* xferinfo_func)
+void pkgi_http_set_rate_limit(uint32_t global_rate, uint32_t transfer_rate, int start_hour, int end_hour)
+{
+    sysMutexLock(g_rate_lock, 0);
+    g_rate.rate = global_rate;
+    g_rate.tokens = 0;
+    g_rate.updated = pkgi_time_msec();
+    g_transfer_rate = transfer_rate;
+    g_rate_start_hour = start_hour;
+    g_rate_end_hour = end_hour;
+    sysMutexUnlock(g_rate_lock);
+
+    LOG("rate limit: %u B/s global (%d-%d h), %u B/s per transfer", global_rate, start_hour, end_hour, transfer_rate);
+}
+
+// the global limit only applies between start and end hour, or all day if they are equal
+static int global_rate_active(void)
+{
+    if (!g_rate.rate)
+    {
+        return 0;
+    }
+    if (g_rate_start_hour == g_rate_end_hour)
+    {
+        return 1;
+    }
+
+    time_t now = time(NULL);
+    int hour = localtime(&now)->tm_hour;
+
+    if (g_rate_start_hour < g_rate_end_hour)
+    {
+        return (hour >= g_rate_start_hour && hour < g_rate_end_hour);
+    }
+    return (hour >= g_rate_start_hour || hour < g_rate_end_hour);
+}
+
+static void rate_refill(rate_bucket* bucket, uint32_t now)
+{
+    // a paused transfer may only be resumed once a second, so allow that much burst
+    int64_t max = bucket->rate + CURL_MAX_WRITE_SIZE;
+
+    bucket->tokens += (int64_t)bucket->rate * (now - bucket->updated) / 1000;
+    bucket->tokens = bucket->tokens > max ? max : bucket->tokens;
+    bucket->updated = now;
+}
+
+// takes size tokens from the transfer and global buckets if both have some left;
+// buckets can go negative, so any write size eventually gets through
+static int rate_take(pkgi_http* http, size_t size)
+{
+    if (!http->rate.rate && !g_rate.rate)
+    {
+        return 1;
+    }
+
+    uint32_t now = pkgi_time_msec();
+    int ok = 1;
+
+    if (http->rate.rate)
+    {
+        rate_refill(&http->rate, now);
+        ok = (http->rate.tokens > 0);
+    }
+
+    sysMutexLock(g_rate_lock, 0);
+    int global = global_rate_active();
+    if (global)
+    {
+        rate_refill(&g_rate, now);
+        ok = ok && (g_rate.tokens > 0);
+    }
+
+    if (ok && size)
+    {
+        http->rate.tokens -= size;
+        if (global)
+        {
+            g_rate.tokens -= size;
+        }
+    }
+    sysMutexUnlock(g_rate_lock);
+
+    return ok;
+}
+
+// curl calls this at least once a second, also while the transfer is paused
+static int pkgi_http_progress(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    pkgi_http* http = (pkgi_http*) p;
+
+    if (http->paused && rate_take(http, 0))
+    {
+        http->paused = 0;
+        curl_easy_pause(http->curl, CURLPAUSE_CONT);
+    }
+
+    return (http->xferinfo_func ? http->xferinfo_func(NULL, dltotal, dlnow, ultotal, ulnow) : 0);
+}
+
+static size_t pkgi_http_write(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    pkgi_http* http = (pkgi_http*) userp;
+
+    // the final response headers are complete once the first body chunk arrives
+    if (!http->length_checked)
+    {
+        curl_off_t length = -1;
+
+        http->length_checked = 1;
+        curl_easy_getinfo(http->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        LOG("http response length = %lld", length);
+        http->size = length;
+
+        // a server that ignores the range would send data from the start of the file
+        long status = 0;
+        curl_easy_getinfo(http->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (http->offset && status == 200)
+        {
+            LOG("http server ignored range request @ %llu", http->offset);
+            return 0;
+        }
+
+        if (http->length_func && !http->length_func(length))
+        {
+            LOG("http transfer rejected (length %lld)", length);
+            return 0;
+        }
+    }
+
+    // out of tokens, curl keeps the data until the progress callback resumes the transfer
+    if (!rate_take(http, size * nmemb))
+    {
+        http->paused = 1;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    return http->write_func(buffer, size, nmemb, NULL);
+}
+
+int pkgi_http_read(pkgi_http* http, void* write_func, pkgi_http_length_func* length_func, void* xferinfo_func)
 {
     CURLcode res;
 
+    http->write_func = (curl_write_callback) write_func;
+    http->xferinfo_func = (curl_xferinfo_callback) xferinfo_func;
+    http->length_func = length_func;
+    http->length_checked = 0;
+    http->paused = 0;
+    http->rate.rate = g_transfer_rate;
+    http->rate.tokens = 0;
+    http->rate.updated = pkgi_time_msec();
+
     curl_easy_setopt(http->curl, CURLOPT_NOBODY, 0L);
     // The function that will be used to write the data
-    curl_easy_setopt(http->curl, CURLOPT_WRITEFUNCTION, write_func);
+    curl_easy_setopt(http->curl, CURLOPT_WRITEFUNCTION, pkgi_http_write);
     // The data file descriptor which will be written to
-    curl_easy_setopt(http->curl, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(http->curl, CURLOPT_WRITEDATA, (void *)http);
 
-    if (xferinfo_func)
-    {
-        /* pass the struct pointer into the xferinfo function */
-        curl_easy_setopt(http->curl, CURLOPT_XFERINFOFUNCTION, xferinfo_func);
-        curl_easy_setopt(http->curl, CURLOPT_XFERINFODATA, NULL);
-        curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, 0L);
-    }
+    // the progress callback resumes rate limited transfers, and forwards to xferinfo_func
+    curl_easy_setopt(http->curl, CURLOPT_XFERINFOFUNCTION, pkgi_http_progress);
+    curl_easy_setopt(http->curl, CURLOPT_XFERINFODATA, (void *)http);
+    curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, 0L);
 
     // Perform the request
     res = curl_easy_perform(http->curl);
+    http->result = res;
 
     if(res != CURLE_OK)
     {
-        LOG("curl_easy_perform() failed: %s", curl_easy_strerror(res));
+        long status = 0;
+        curl_easy_getinfo(http->curl, CURLINFO_RESPONSE_CODE, &status);
+        LOG("curl_easy_perform() failed: %s (http status %ld)", curl_easy_strerror(res), status);
         return 0;
     }
 
+    // empty body, the write callback never ran
+    if (!http->length_checked && http->length_func)
+    {
+        curl_off_t length = -1;
+
+        curl_easy_getinfo(http->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        http->size = length;
+        http->length_checked = 1;
+        return http->length_func(length);
+    }
+
     return 1;
 }
 
+const char* pkgi_http_error(pkgi_http* http)
+{
+    return curl_easy_strerror(http->result);
+}
+
+int pkgi_http_can_retry(pkgi_http* http)
+{
+    long status = 0;
+
+    switch (http->result)
+    {
+    case CURLE_HTTP_RETURNED_ERROR:
+        // server errors and throttling are transient, other 4xx are not
+        curl_easy_getinfo(http->curl, CURLINFO_RESPONSE_CODE, &status);
+        return (status == 408 || status == 429 || status >= 500);
+
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_SSL_CONNECT_ERROR:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
 void pkgi_http_close(pkgi_http* http)
 {
     LOG("http close");
-    curl_easy_cleanup(http->curl);
-
-    http->used = 0;
+    pkgi_http_release(http);
 }
 
 int pkgi_mkdirs(const char* dir)
@@ -1356,13 +1880,13 @@ void* pkgi_open(const char* path)
     return (void*)fd;
 }
 
-void* pkgi_append(const char* path)
+void* pkgi_open_rw(const char* path)
 {
-    LOG("fopen append on %s", path);
-    FILE* fd = fopen(path, "ab");
+    LOG("fopen open r+b on %s", path);
+    FILE* fd = fopen(path, "r+b");
     if (!fd)
     {
-        LOG("cannot append %s, err=0x%08x", path, fd);
+        LOG("cannot open %s, err=0x%08x", path, fd);
         return NULL;
     }
     LOG("fopen returned fd=%d", fd);
@@ -1385,6 +1909,16 @@ int pkgi_read(void* f, void* buffer, uint32_t size)
     return read;
 }
 
+int pkgi_read_at(void* f, uint64_t offset, void* buffer, uint32_t size)
+{
+    if (fseeko((FILE*)f, offset, SEEK_SET) != 0)
+    {
+        LOG("fseeko error at offset %llu", offset);
+        return -1;
+    }
+    return pkgi_read(f, buffer, size);
+}
+
 int pkgi_write(void* f, const void* buffer, uint32_t size)
 {
 //    LOG("asking to write %u bytes", size);
@@ -1400,6 +1934,26 @@ int pkgi_write(void* f, const void* buffer, uint32_t size)
     return (write == 1);
 }
 
+int pkgi_write_at(void* f, uint64_t offset, const void* buffer, uint32_t size)
+{
+    if (fseeko((FILE*)f, offset, SEEK_SET) != 0)
+    {
+        LOG("fseeko error at offset %llu", offset);
+        return 0;
+    }
+    return pkgi_write(f, buffer, size);
+}
+
+int pkgi_sync(void* f)
+{
+    if (fflush((FILE*)f) != 0 || fsync(fileno((FILE*)f)) != 0)
+    {
+        LOG("error syncing file %d", f);
+        return 0;
+    }
+    return 1;
+}
+
 void pkgi_close(void* f)
 {
     FILE *fd = (FILE*)f;
@@ -1411,20 +1965,54 @@ void pkgi_close(void* f)
     }
 }
 
+// keeps room for the terminating zero
+static int curl_reserve_memory(curl_memory_t *mem, size_t size)
+{
+    if (size + 1 <= mem->capacity)
+    {
+        return 1;
+    }
+
+    char *ptr = realloc(mem->memory, size + 1);
+    if (!ptr)
+    {
+        LOG("not enough memory (realloc %lu)", (unsigned long)(size + 1));
+        return 0;
+    }
+
+    mem->memory = ptr;
+    mem->capacity = size + 1;
+    return 1;
+}
+
 static size_t curl_write_memory(void *contents, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
     curl_memory_t *mem = (curl_memory_t *)userp;
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if(!ptr)
+    if (!mem->length_checked)
     {
-        /* out of memory! */
-        LOG("not enough memory (realloc)");
-        return 0;
+        // with a known content length the whole response fits in one allocation
+        curl_off_t length = -1;
+        curl_easy_getinfo(mem->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        mem->length_checked = 1;
+
+        if (length > 0 && length < UINT32_MAX && !curl_reserve_memory(mem, (size_t)length))
+        {
+            return 0;
+        }
+    }
+
+    if (mem->size + realsize + 1 > mem->capacity)
+    {
+        // otherwise grow geometrically, so large responses are not copied over and over
+        size_t grow = max32(mem->capacity * 2, 64 * 1024);
+        if (!curl_reserve_memory(mem, max32(mem->size + realsize, grow)))
+        {
+            return 0;
+        }
     }
 
-    mem->memory = ptr;
     memcpy(&(mem->memory[mem->size]), contents, realsize);
     mem->size += realsize;
     mem->memory[mem->size] = 0;
@@ -1432,47 +2020,247 @@ static size_t curl_write_memory(void *contents, size_t size, size_t nmemb, void
     return realsize;
 }
 
-char * pkgi_http_download_buffer(const char* url, uint32_t* buf_size)
+int pkgi_http_download_reuse(const char* url, char** buffer, uint32_t* capacity, uint32_t* buf_size)
 {
-    CURL *curl;
+    pkgi_http* http;
     CURLcode res;
     curl_memory_t chunk;
 
-    curl = curl_easy_init();
-    if(!curl)
+    http = pkgi_http_acquire(url);
+    if(!http)
     {
         LOG("cURL init error");
-        return NULL;
+        return 0;
     }
-    
-    chunk.memory = malloc(1);   /* will be grown as needed by the realloc above */
+
+    chunk.curl = http->curl;
+    chunk.memory = *buffer;     /* grown as needed by curl_write_memory */
+    chunk.capacity = *buffer ? *capacity : 0;
     chunk.size = 0;             /* no data at this point */
+    chunk.length_checked = 0;
 
-    pkgi_curl_init(curl);
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, 1L);
     // The function that will be used to write the data
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
+    curl_easy_setopt(http->curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
     // The data file descriptor which will be written to
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(http->curl, CURLOPT_WRITEDATA, (void *)&chunk);
 
     // Perform the request
-    res = curl_easy_perform(curl);
+    res = curl_easy_perform(http->curl);
+
+    // clean-up
+    pkgi_http_release(http);
+
+    // the caller keeps the buffer even on failure
+    *buffer = chunk.memory;
+    *capacity = chunk.capacity;
 
     if(res != CURLE_OK)
     {
         LOG("curl_easy_perform() failed: %s", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        free(chunk.memory);
-        return NULL;
+        return 0;
     }
 
+    if (!curl_reserve_memory(&chunk, chunk.size))
+    {
+        return 0;
+    }
+    *buffer = chunk.memory;
+    *capacity = chunk.capacity;
+    chunk.memory[chunk.size] = 0;
+
     LOG("%lu bytes retrieved", (unsigned long)chunk.size);
-    // clean-up
-    curl_easy_cleanup(curl);
 
     *buf_size = chunk.size;
-    return (chunk.memory);
+    return 1;
+}
+
+char * pkgi_http_download_buffer(const char* url, uint32_t* buf_size)
+{
+    char *buffer = NULL;
+    uint32_t capacity = 0;
+
+    if (!pkgi_http_download_reuse(url, &buffer, &capacity, buf_size))
+    {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+static size_t batch_header(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    size_t realsize = size * nitems;
+    curl_memory_t *mem = (curl_memory_t *)userp;
+
+    // "ETag: <value>\r\n", a redirect overwrites the etag of the previous response
+    if (realsize > 5 && strncasecmp(buffer, "ETag:", 5) == 0)
+    {
+        size_t start = 5;
+        while (start < realsize && buffer[start] == ' ')
+        {
+            start++;
+        }
+
+        size_t end = realsize;
+        while (end > start && (buffer[end - 1] == '\r' || buffer[end - 1] == '\n' || buffer[end - 1] == ' '))
+        {
+            end--;
+        }
+
+        pkgi_snprintf(mem->etag, sizeof(mem->etag), "%.*s", (int)(end - start), buffer + start);
+    }
+    return realsize;
+}
+
+static void batch_start(CURLM* multi, pkgi_http* http, curl_memory_t* chunk, const pkgi_http_batch_item* item)
+{
+    curl_easy_reset(http->curl);
+    pkgi_curl_init(http->curl);
+    curl_easy_setopt(http->curl, CURLOPT_URL, item->url);
+    curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(http->curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
+    curl_easy_setopt(http->curl, CURLOPT_WRITEDATA, (void *)chunk);
+    curl_easy_setopt(http->curl, CURLOPT_HEADERFUNCTION, batch_header);
+    curl_easy_setopt(http->curl, CURLOPT_HEADERDATA, (void *)chunk);
+
+    chunk->curl = http->curl;
+    chunk->size = 0;
+    chunk->length_checked = 0;
+    chunk->etag[0] = 0;
+
+    curl_slist_free_all(chunk->headers);
+    chunk->headers = NULL;
+    if (item->etag)
+    {
+        char header[128];
+        pkgi_snprintf(header, sizeof(header), "If-None-Match: %s", item->etag);
+        chunk->headers = curl_slist_append(NULL, header);
+        curl_easy_setopt(http->curl, CURLOPT_HTTPHEADER, chunk->headers);
+    }
+
+    curl_multi_add_handle(multi, http->curl);
+}
+
+int pkgi_http_download_batch(const pkgi_http_batch_item* items, uint32_t count, uint32_t parallel, pkgi_http_batch_func* done, void* user)
+{
+    pkgi_http* http[PKGI_HTTP_POOL_SIZE];
+    curl_memory_t chunk[PKGI_HTTP_POOL_SIZE];
+    uint32_t index[PKGI_HTTP_POOL_SIZE];
+    int active[PKGI_HTTP_POOL_SIZE];
+    uint32_t slots, next = 0, finished = 0;
+    int cancel = 0;
+
+    if (count == 0)
+    {
+        return 1;
+    }
+
+    CURLM* multi = curl_multi_init();
+    if (!multi)
+    {
+        LOG("curl multi init error");
+        return 0;
+    }
+
+    // handles come from the shared pool, whatever a running download holds is left alone
+    parallel = min32(min32(parallel, PKGI_HTTP_POOL_SIZE), count);
+    for (slots = 0; slots < parallel; slots++)
+    {
+        http[slots] = pkgi_http_acquire(items[next].url);
+        if (!http[slots])
+        {
+            break;
+        }
+
+        chunk[slots].memory = NULL;
+        chunk[slots].capacity = 0;
+        chunk[slots].headers = NULL;
+        batch_start(multi, http[slots], &chunk[slots], &items[next]);
+        index[slots] = next++;
+        active[slots] = 1;
+    }
+    LOG("fetching %u urls over %u connections", count, slots);
+
+    while (slots && finished < count && !cancel)
+    {
+        int running;
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+        {
+            LOG("curl_multi_perform() failed");
+            break;
+        }
+
+        CURLMsg* msg;
+        int left;
+        while (!cancel && (msg = curl_multi_info_read(multi, &left)) != NULL)
+        {
+            if (msg->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            // msg is gone once the handle is removed
+            CURL* curl = msg->easy_handle;
+            CURLcode res = msg->data.result;
+
+            uint32_t i = 0;
+            while (i < slots && http[i]->curl != curl)
+            {
+                i++;
+            }
+            if (i == slots)
+            {
+                continue;
+            }
+
+            long status = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            curl_multi_remove_handle(multi, curl);
+            active[i] = 0;
+            finished++;
+
+            if (res == CURLE_OK && curl_reserve_memory(&chunk[i], chunk[i].size))
+            {
+                chunk[i].memory[chunk[i].size] = 0;
+                cancel = done(index[i], (int)status, chunk[i].memory, chunk[i].size, chunk[i].etag, user);
+            }
+            else
+            {
+                LOG("batch request %s failed: %s (%ld)", items[index[i]].url, curl_easy_strerror(res), status);
+                cancel = done(index[i], (int)status, NULL, 0, "", user);
+            }
+
+            // the connection is reused for the next url, its buffer too
+            if (!cancel && next < count)
+            {
+                batch_start(multi, http[i], &chunk[i], &items[next]);
+                index[i] = next++;
+                active[i] = 1;
+            }
+        }
+
+        if (!cancel && finished < count)
+        {
+            curl_multi_wait(multi, NULL, 0, 100, NULL);
+        }
+    }
+
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        if (active[i])
+        {
+            curl_multi_remove_handle(multi, http[i]->curl);
+        }
+        // the pooled handle must not keep pointing at the freed header list
+        curl_easy_setopt(http[i]->curl, CURLOPT_HTTPHEADER, NULL);
+        curl_slist_free_all(chunk[i].headers);
+        free(chunk[i].memory);
+        pkgi_http_release(http[i]);
+    }
+    curl_multi_cleanup(multi);
+
+    return slots && finished == count;
 }
 
 const char * pkgi_get_user_language()
@@ -0,0 +1,199 @@
+#include "pkgi_queue.h"
+#include "pkgi.h"
+#include "pkgi_db.h"
+
+#define QUEUE_CONTENT_SIZE 64
+
+static char queue[PKGI_QUEUE_SIZE][QUEUE_CONTENT_SIZE];
+static uint32_t queue_count;
+static pkgi_mutex queue_lock;
+
+// item sizes looked up in the db once per queue change, 0 if unknown
+static uint64_t queue_bytes[PKGI_QUEUE_SIZE];
+static uint64_t queue_total;
+static int queue_dirty;
+
+// used with queue_lock held
+static char queue_data[PKGI_QUEUE_SIZE * QUEUE_CONTENT_SIZE];
+
+static void get_queue_path(char* path, uint32_t size)
+{
+    pkgi_snprintf(path, size, "%s/queue.txt", pkgi_get_config_folder());
+}
+
+static int find_item(const char* content)
+{
+    for (uint32_t i = 0; i < queue_count; i++)
+    {
+        if (pkgi_stricmp(queue[i], content) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// used with queue_lock held
+static void update_sizes(void)
+{
+    queue_total = 0;
+    for (uint32_t i = 0; i < queue_count; i++)
+    {
+        const DbItem* item = pkgi_db_find(queue[i]);
+        queue_bytes[i] = item && item->size > 0 ? item->size : 0;
+        queue_total += queue_bytes[i];
+    }
+    queue_dirty = 0;
+}
+
+static void save_queue(void)
+{
+    queue_dirty = 1;
+
+    char path[256];
+    int len = 0;
+
+    get_queue_path(path, sizeof(path));
+    if (queue_count == 0)
+    {
+        pkgi_rm(path);
+        return;
+    }
+
+    for (uint32_t i = 0; i < queue_count; i++)
+    {
+        len += pkgi_snprintf(queue_data + len, sizeof(queue_data) - len, "%s\n", queue[i]);
+    }
+
+    if (!pkgi_save(path, queue_data, len))
+    {
+        LOG("cannot save %s", path);
+    }
+}
+
+void pkgi_queue_init(void)
+{
+    char path[256];
+
+    if (!pkgi_mutex_create(&queue_lock, "queue_lock"))
+    {
+        LOG("cannot create queue mutex");
+    }
+
+    queue_count = 0;
+    queue_dirty = 1;
+    get_queue_path(path, sizeof(path));
+
+    int loaded = pkgi_load(path, queue_data, sizeof(queue_data) - 1);
+    if (loaded <= 0)
+    {
+        LOG("download queue is empty");
+        return;
+    }
+    queue_data[loaded] = 0;
+
+    char* ptr = queue_data;
+    while (*ptr && queue_count < PKGI_QUEUE_SIZE)
+    {
+        char* content = ptr;
+        while (*ptr && *ptr != '\n' && *ptr != '\r')
+        {
+            ptr++;
+        }
+        while (*ptr == '\n' || *ptr == '\r')
+        {
+            *ptr++ = 0;
+        }
+
+        if (*content && find_item(content) < 0)
+        {
+            pkgi_strncpy(queue[queue_count++], QUEUE_CONTENT_SIZE, content);
+        }
+    }
+
+    LOG("loaded %u queued downloads", queue_count);
+}
+
+int pkgi_queue_add(const char* content)
+{
+    int added = 0;
+
+    pkgi_mutex_lock(queue_lock);
+    if (queue_count < PKGI_QUEUE_SIZE && find_item(content) < 0)
+    {
+        pkgi_strncpy(queue[queue_count++], QUEUE_CONTENT_SIZE, content);
+        save_queue();
+        added = 1;
+    }
+    pkgi_mutex_unlock(queue_lock);
+
+    return added;
+}
+
+void pkgi_queue_remove(const char* content)
+{
+    pkgi_mutex_lock(queue_lock);
+    int index = find_item(content);
+    if (index >= 0)
+    {
+        queue_count--;
+        pkgi_memmove(queue[index], queue[index + 1], (queue_count - index) * QUEUE_CONTENT_SIZE);
+        save_queue();
+    }
+    pkgi_mutex_unlock(queue_lock);
+}
+
+int pkgi_queue_contains(const char* content)
+{
+    pkgi_mutex_lock(queue_lock);
+    int found = find_item(content) >= 0;
+    pkgi_mutex_unlock(queue_lock);
+
+    return found;
+}
+
+uint32_t pkgi_queue_count(void)
+{
+    return queue_count;
+}
+
+void pkgi_queue_refresh(void)
+{
+    pkgi_mutex_lock(queue_lock);
+    queue_dirty = 1;
+    pkgi_mutex_unlock(queue_lock);
+}
+
+uint64_t pkgi_queue_size(const char* skip)
+{
+    pkgi_mutex_lock(queue_lock);
+    if (queue_dirty)
+    {
+        update_sizes();
+    }
+
+    uint64_t size = queue_total;
+    int index = find_item(skip);
+    if (index >= 0)
+    {
+        size -= queue_bytes[index];
+    }
+    pkgi_mutex_unlock(queue_lock);
+
+    return size;
+}
+
+int pkgi_queue_get(uint32_t index, char* content, uint32_t size)
+{
+    int found = 0;
+
+    pkgi_mutex_lock(queue_lock);
+    if (index < queue_count)
+    {
+        pkgi_strncpy(content, size, queue[index]);
+        found = 1;
+    }
+    pkgi_mutex_unlock(queue_lock);
+
+    return found;
+}
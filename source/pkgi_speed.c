@@ -0,0 +1,63 @@
+#include "pkgi_speed.h"
+#include "pkgi.h"
+
+#define SPEED_SAMPLE_MSEC 250
+
+// older samples fade out with this time constant
+#define SPEED_SMOOTH_MSEC 3000
+
+void pkgi_speed_reset(pkgi_speed* speed, uint64_t bytes)
+{
+    speed->last_bytes = bytes;
+    speed->last_time = pkgi_time_msec();
+    speed->rate = 0.f;
+}
+
+void pkgi_speed_update(pkgi_speed* speed, uint64_t bytes)
+{
+    uint32_t now = pkgi_time_msec();
+    uint32_t elapsed = now - speed->last_time;
+    if (elapsed < SPEED_SAMPLE_MSEC)
+    {
+        return;
+    }
+
+    // position went back (retry from an earlier offset), nothing to measure
+    if (bytes < speed->last_bytes)
+    {
+        speed->last_bytes = bytes;
+        speed->last_time = now;
+        return;
+    }
+
+    float sample = (float)(bytes - speed->last_bytes) * 1000.f / elapsed;
+    if (speed->rate == 0.f)
+    {
+        speed->rate = sample;
+    }
+    else
+    {
+        // weight grows with the sample length, so irregular callbacks average correctly
+        float weight = (float)elapsed / (elapsed + SPEED_SMOOTH_MSEC);
+        speed->rate += weight * (sample - speed->rate);
+    }
+
+    speed->last_bytes = bytes;
+    speed->last_time = now;
+}
+
+uint32_t pkgi_speed_rate(const pkgi_speed* speed)
+{
+    return (uint32_t)speed->rate;
+}
+
+uint32_t pkgi_speed_eta(const pkgi_speed* speed, uint64_t remaining)
+{
+    uint32_t rate = pkgi_speed_rate(speed);
+    if (rate == 0)
+    {
+        return 0;
+    }
+    uint64_t seconds = remaining / rate;
+    return seconds > UINT32_MAX ? UINT32_MAX : (uint32_t)seconds;
+}
@@ -4,6 +4,7 @@
 #include <ft2build.h>
 #include <freetype/freetype.h> 
 #include <freetype/ftglyph.h>
+#include <stdlib.h>
 #include "ttf_render.h"
 
 /******************************************************************************************************************************************************/
@@ -16,6 +17,87 @@ static FT_Library freetype;
 static FT_Face face[4];
 static int f_face[4] = {0, 0, 0, 0};
 
+// pixel size last set on each face
+static int face_w[4];
+static int face_h[4];
+
+#define TTF_UX 30
+#define TTF_UY 24
+
+// face serving each codepoint, resolved 256 codepoints at a time when first needed
+#define TTF_BLOCK_BITS 8
+#define TTF_BLOCK_SIZE (1 << TTF_BLOCK_BITS)
+#define TTF_BLOCKS (0x110000 >> TTF_BLOCK_BITS)
+#define TTF_NO_FACE 0xff
+
+static u8 *face_blocks[TTF_BLOCKS];
+
+static void reset_face_blocks(void)
+{
+    int n;
+
+    for(n = 0; n < TTF_BLOCKS; n++) {
+        free(face_blocks[n]);
+        face_blocks[n] = NULL;
+    }
+}
+
+static void set_face_size(int n, int w, int h)
+{
+    if(face_w[n] == w && face_h[n] == h) return;
+
+    FT_Set_Pixel_Sizes(face[n], w, h);
+    face_w[n] = w;
+    face_h[n] = h;
+}
+
+static int probe_face(u32 ttf_char)
+{
+    int n;
+
+    for(n = 0; n < 4; n++) {
+        if(f_face[n] && FT_Get_Char_Index(face[n], ttf_char) != 0) return n;
+    }
+
+    return TTF_NO_FACE;
+}
+
+static int find_face(u32 ttf_char)
+{
+    int n;
+
+    if(ttf_char >= 0x110000) return TTF_NO_FACE;
+
+    u8 *block = face_blocks[ttf_char >> TTF_BLOCK_BITS];
+
+    if(!block) {
+        block = malloc(TTF_BLOCK_SIZE);
+        if(!block) return probe_face(ttf_char);
+
+        u32 base = ttf_char & ~(TTF_BLOCK_SIZE - 1);
+        for(n = 0; n < TTF_BLOCK_SIZE; n++) block[n] = probe_face(base + n);
+
+        face_blocks[ttf_char >> TTF_BLOCK_BITS] = block;
+    }
+
+    return block[ttf_char & (TTF_BLOCK_SIZE - 1)];
+}
+
+// loads and renders a character from the first face that has it, NULL if none does
+static FT_GlyphSlot render_glyph(u32 ttf_char, int w, int h)
+{
+    int n = find_face(ttf_char);
+
+    if(n == TTF_NO_FACE) return NULL;
+
+    set_face_size(n, w, h);
+
+    FT_UInt index = FT_Get_Char_Index(face[n], ttf_char);
+    if(FT_Load_Glyph(face[n], index, FT_LOAD_RENDER)) return NULL;
+
+    return face[n]->glyph;
+}
+
 int TTFLoadFont(int set, char * path, void * from_memory, int size_from_memory)
 {
    
@@ -24,6 +106,7 @@ int TTFLoadFont(int set, char * path, void * from_memory, int size_from_memory)
     ttf_inited = 1;
 
     f_face[set] = 0;
+    reset_face_blocks();
 
     if(path) {
         if(FT_New_Face(freetype, path, 0, &face[set])<0) return -1;
@@ -33,6 +116,9 @@ int TTFLoadFont(int set, char * path, void * from_memory, int size_from_memory)
 
     f_face[set] = 1;
 
+    // set on the first glyph rendered, and again only when a glyph of another size is rendered
+    face_w[set] = face_h[set] = 0;
+
     return 0;
 }
 
@@ -42,6 +128,8 @@ void TTFUnloadFont()
 {
    if(!ttf_inited) return;
    FT_Done_FreeType(freetype);
+   f_face[0] = f_face[1] = f_face[2] = f_face[3] = 0;
+   reset_face_blocks();
    ttf_inited = 0;
 }
 
@@ -60,26 +148,11 @@ y_correction : the Y correction to display the character correctly in the screen
 
 void TTF_to_Bitmap(u8 chr, u8 * bitmap, short *w, short *h, short *y_correction)
 {
-    if(f_face[0]) FT_Set_Pixel_Sizes(face[0], (*w), (*h));
-    if(f_face[1]) FT_Set_Pixel_Sizes(face[1], (*w), (*h));
-    if(f_face[2]) FT_Set_Pixel_Sizes(face[2], (*w), (*h));
-    if(f_face[3]) FT_Set_Pixel_Sizes(face[3], (*w), (*h));
-    
-    FT_GlyphSlot slot;
-
     memset(bitmap, 0, (*w) * (*h));
 
-    FT_UInt index;
+    FT_GlyphSlot slot = render_glyph(chr, (*w), (*h));
 
-    if(f_face[0] && (index = FT_Get_Char_Index(face[0], (char) chr))!=0 
-        && !FT_Load_Glyph(face[0], index, FT_LOAD_RENDER )) slot = face[0]->glyph;
-    else if(f_face[1] && (index = FT_Get_Char_Index(face[1], (char) chr))!=0 
-        && !FT_Load_Glyph(face[1], index, FT_LOAD_RENDER )) slot = face[1]->glyph;
-    else if(f_face[2] && (index = FT_Get_Char_Index(face[2], (char) chr))!=0 
-        && !FT_Load_Glyph(face[2], index, FT_LOAD_RENDER )) slot = face[2]->glyph;
-    else if(f_face[3] && (index = FT_Get_Char_Index(face[3], (char) chr))!=0 
-        && !FT_Load_Glyph(face[3], index, FT_LOAD_RENDER )) slot = face[3]->glyph;
-    else {(*w) = 0; return;}
+    if(!slot) {(*w) = 0; return;}
 
     int n, m, ww;
 
@@ -111,12 +184,6 @@ int Render_String_UTF8(u16 * bitmap, int w, int h, u8 *string, int sw, int sh)
     u8 color;
     u32 ttf_char;
 
-    if(f_face[0]) FT_Set_Pixel_Sizes(face[0], sw, sh);
-    if(f_face[1]) FT_Set_Pixel_Sizes(face[1], sw, sh);
-    if(f_face[2]) FT_Set_Pixel_Sizes(face[2], sw, sh);
-    if(f_face[3]) FT_Set_Pixel_Sizes(face[3], sw, sh);
-
-    //FT_Set_Pixel_Sizes(face, sw, sh);
     FT_GlyphSlot slot = NULL;
 
     memset(bitmap, 0, w * h * 2);
@@ -151,16 +218,9 @@ int Render_String_UTF8(u16 * bitmap, int w, int h, u8 *string, int sw, int sh)
 
         if(ttf_char == 13 || ttf_char == 10) ttf_char='/';
 
-        FT_UInt index;
+        FT_GlyphSlot glyph = render_glyph(ttf_char, sw, sh);
 
-        if(f_face[0] && (index = FT_Get_Char_Index(face[0], ttf_char))!=0 
-            && !FT_Load_Glyph(face[0], index, FT_LOAD_RENDER )) slot = face[0]->glyph;
-        else if(f_face[1] && (index = FT_Get_Char_Index(face[1], ttf_char))!=0 
-            && !FT_Load_Glyph(face[1], index, FT_LOAD_RENDER )) slot = face[1]->glyph;
-        else if(f_face[2] && (index = FT_Get_Char_Index(face[2], ttf_char))!=0 
-            && !FT_Load_Glyph(face[2], index, FT_LOAD_RENDER )) slot = face[2]->glyph;
-        else if(f_face[3] && (index = FT_Get_Char_Index(face[3], ttf_char))!=0 
-            && !FT_Load_Glyph(face[3], index, FT_LOAD_RENDER )) slot = face[3]->glyph;
+        if(glyph) slot = glyph;
         else ttf_char = 0;
 
         if(ttf_char!=0 && slot->bitmap.buffer) {
@@ -196,9 +256,11 @@ int Render_String_UTF8(u16 * bitmap, int w, int h, u8 *string, int sw, int sh)
 // constructor dinamico de fuentes 32 x 32
 
 typedef struct ttf_dyn {
-    u32 ttf;
+    u32 key;        // codepoint and size index
     u16 *text;
-    u32 r_use;
+    u16 prev;       // LRU list links of its size, or free list link
+    u16 next;
+    u16 size;
     u16 y_start;
     u16 width;
     u16 height;
@@ -208,9 +270,75 @@ typedef struct ttf_dyn {
 
 #define MAX_CHARS 1600
 
+// all glyph slots are 32x32 cells of a single A4R4G4B4 atlas texture
+#define TTF_CELL 32
+#define TTF_ATLAS_CELLS 40
+#define TTF_ATLAS_SIZE (TTF_CELL * TTF_ATLAS_CELLS)
+
+// glyphs of a string are drawn as one batch of quads
+#define TTF_MAX_QUADS 256
+
+// (codepoint, size) -> slot, open addressing with linear probing
+#define TTF_HASH_BITS 12
+#define TTF_HASH_SIZE (1 << TTF_HASH_BITS)
+#define TTF_NONE 0xffff
+
+#define TTF_KEY(ttf, size) ((ttf) | ((u32) (size) << 21))
+
+// glyph sizes in use, the slots are shared between them
+#define TTF_MAX_SIZES 4
+
+typedef struct ttf_size {
+    u16 sw;         // requested character size
+    u16 sh;
+    u16 rw;         // size the glyphs are rasterized at
+    u16 rh;
+    float sx;       // raster to screen scale
+    float sy;
+    u16 count;      // slots held
+    u16 lru_head;   // most and least recently used slots
+    u16 lru_tail;
+    u32 r_use;      // frame it was last drawn in
+} ttf_size;
+
 static ttf_dyn ttf_font_datas[MAX_CHARS];
 
-static u32 r_use= 0;
+static ttf_size ttf_sizes[TTF_MAX_SIZES];
+static int size_count = 0;
+
+static u16 free_head = TTF_NONE;
+static u32 r_use = 0;
+
+static u16 ttf_hash[TTF_HASH_SIZE];
+
+static u16 *ttf_atlas;
+static u32 ttf_atlas_offset;
+
+typedef struct ttf_quad {
+    float x, y;
+    float w, h;
+    float u, v;
+    float tw, th;
+} ttf_quad;
+
+static ttf_quad ttf_quads[TTF_MAX_QUADS];
+static int quad_count = 0;
+
+// measured string widths, direct mapped by string hash
+#define TTF_WIDTH_CACHE 128
+
+typedef struct ttf_width {
+    u32 hash;
+    u32 len;
+    u16 sw;
+    u16 sh;
+    u32 mode;
+    int win_w;
+    int win_h;
+    int width;
+} ttf_width;
+
+static ttf_width ttf_widths[TTF_WIDTH_CACHE];
 
 float Y_ttf = 0.0f;
 float Z_ttf = 0.0f;
@@ -235,34 +363,205 @@ void set_ttf_window(int x, int y, int width, int height, u32 mode)
    
 }
 
+static inline u32 hash_slot(u32 key)
+{
+    return (key * 2654435761u) >> (32 - TTF_HASH_BITS);
+}
+
+static u16 hash_find(u32 key)
+{
+    u32 h = hash_slot(key);
+
+    while(ttf_hash[h] != TTF_NONE) {
+        if(ttf_font_datas[ttf_hash[h]].key == key) return ttf_hash[h];
+        h = (h + 1) & (TTF_HASH_SIZE - 1);
+    }
+
+    return TTF_NONE;
+}
+
+static void hash_insert(u32 key, u16 slot)
+{
+    u32 h = hash_slot(key);
+
+    while(ttf_hash[h] != TTF_NONE) h = (h + 1) & (TTF_HASH_SIZE - 1);
+
+    ttf_hash[h] = slot;
+}
+
+// backward shift deletion, keeps probe chains intact without tombstones
+static void hash_remove(u32 key)
+{
+    u32 h = hash_slot(key);
+
+    while(ttf_hash[h] != TTF_NONE && ttf_font_datas[ttf_hash[h]].key != key) h = (h + 1) & (TTF_HASH_SIZE - 1);
+    if(ttf_hash[h] == TTF_NONE) return;
+
+    u32 n = h;
+    for(;;) {
+        n = (n + 1) & (TTF_HASH_SIZE - 1);
+        if(ttf_hash[n] == TTF_NONE) break;
+
+        // an entry can fill the hole if its home slot is not between the hole and itself
+        u32 home = hash_slot(ttf_font_datas[ttf_hash[n]].key);
+        if(((n - home) & (TTF_HASH_SIZE - 1)) >= ((n - h) & (TTF_HASH_SIZE - 1))) {
+            ttf_hash[h] = ttf_hash[n];
+            h = n;
+        }
+    }
+
+    ttf_hash[h] = TTF_NONE;
+}
+
+static void lru_unlink(ttf_size *s, u16 n)
+{
+    if(ttf_font_datas[n].prev != TTF_NONE) ttf_font_datas[ttf_font_datas[n].prev].next = ttf_font_datas[n].next;
+    else s->lru_head = ttf_font_datas[n].next;
+
+    if(ttf_font_datas[n].next != TTF_NONE) ttf_font_datas[ttf_font_datas[n].next].prev = ttf_font_datas[n].prev;
+    else s->lru_tail = ttf_font_datas[n].prev;
+}
+
+static void lru_push_front(ttf_size *s, u16 n)
+{
+    ttf_font_datas[n].prev = TTF_NONE;
+    ttf_font_datas[n].next = s->lru_head;
+
+    if(s->lru_head != TTF_NONE) ttf_font_datas[s->lru_head].prev = n;
+    else s->lru_tail = n;
+
+    s->lru_head = n;
+}
+
+// drops a glyph from its size and puts its slot in the free list
+static void release_slot(u16 n)
+{
+    ttf_size *s = &ttf_sizes[ttf_font_datas[n].size];
+
+    lru_unlink(s, n);
+    s->count--;
+    hash_remove(ttf_font_datas[n].key);
+
+    ttf_font_datas[n].flags = 0;
+    ttf_font_datas[n].next = free_head;
+    free_head = n;
+}
+
 u16 * init_ttf_table(u16 *texture)
 {
     int n;
 
-    r_use= 0;
+    memset(ttf_hash, 0xff, sizeof(ttf_hash));
+    memset(ttf_widths, 0, sizeof(ttf_widths));
+    size_count = 0;
+    free_head = TTF_NONE;
+
+    ttf_atlas = texture;
+    ttf_atlas_offset = tiny3d_TextureOffset(ttf_atlas);
+    memset(ttf_atlas, 0, TTF_ATLAS_SIZE * TTF_ATLAS_SIZE * 2);
+
     for(n= 0; n <  MAX_CHARS; n++) {
         memset(&ttf_font_datas[n], 0, sizeof(ttf_dyn));
-        ttf_font_datas[n].text = texture;
+        ttf_font_datas[n].text = ttf_atlas + (n / TTF_ATLAS_CELLS) * TTF_CELL * TTF_ATLAS_SIZE + (n % TTF_ATLAS_CELLS) * TTF_CELL;
+    }
 
-        texture+= 32*32;
+    for(n= MAX_CHARS - 1; n >= 0; n--) {
+        ttf_font_datas[n].next = free_head;
+        free_head = n;
     }
 
-    return texture;
+    return texture + TTF_ATLAS_SIZE * TTF_ATLAS_SIZE;
 
 }
 
 void reset_ttf_frame(void)
 {
-    int n;
+    r_use++;
+}
 
-    for(n= 0; n <  MAX_CHARS; n++) {
-        
-        ttf_font_datas[n].flags &= 1;
+// returns the index of a character size, the size drawn least recently is replaced when all are in use
+static int find_ttf_size(int sw, int sh)
+{
+    int n, oldest = 0;
+
+    for(n = 0; n < size_count; n++) {
+        if(ttf_sizes[n].sw == sw && ttf_sizes[n].sh == sh) {
+            ttf_sizes[n].r_use = r_use;
+            return n;
+        }
 
+        if((r_use - ttf_sizes[n].r_use) > (r_use - ttf_sizes[oldest].r_use)) oldest = n;
     }
 
-    r_use++;
+    if(size_count < TTF_MAX_SIZES) n = size_count++;
+    else {
+        n = oldest;
+        while(ttf_sizes[n].lru_head != TTF_NONE) release_slot(ttf_sizes[n].lru_head);
+    }
+
+    ttf_size *s = &ttf_sizes[n];
+
+    // a TTF_UX x TTF_UY glyph in a 32x32 cell scaled to sw x sh, rasterized directly at the size it is drawn
+    s->sw = sw;
+    s->sh = sh;
+    s->rw = TTF_UX * sw / TTF_CELL;
+    s->rh = TTF_UY * sh / TTF_CELL;
+
+    // bigger sizes still scale up glyphs that fill a cell
+    if(s->rw > TTF_UX) s->rw = TTF_UX;
+    if(s->rh > TTF_UY) s->rh = TTF_UY;
+    if(s->rw < 1) s->rw = 1;
+    if(s->rh < 1) s->rh = 1;
 
+    s->sx = (float) (TTF_UX * sw) / (TTF_CELL * s->rw);
+    s->sy = (float) (TTF_UY * sh) / (TTF_CELL * s->rh);
+    s->count = 0;
+    s->lru_head = s->lru_tail = TTF_NONE;
+    s->r_use = r_use;
+
+    return n;
+}
+
+// returns the slot of a character in a size, recycling the least recently used glyph on a miss;
+// every size in use gets an even share of the slots, a size under its share takes from the biggest one
+static int find_ttf_slot(u32 ttf_char, int size)
+{
+    ttf_size *s = &ttf_sizes[size];
+    u32 key = TTF_KEY(ttf_char, size);
+    u16 n = hash_find(key);
+
+    if(n == TTF_NONE) {
+        int budget = MAX_CHARS / size_count;
+
+        if(free_head == TTF_NONE || s->count >= budget) {
+            ttf_size *victim = s;
+
+            if(s->count < budget) {
+                for(n = 0; n < size_count; n++) {
+                    if(ttf_sizes[n].count > victim->count) victim = &ttf_sizes[n];
+                }
+            }
+
+            release_slot(victim->lru_tail);
+        }
+
+        n = free_head;
+        free_head = ttf_font_datas[n].next;
+
+        ttf_font_datas[n].flags = 0;
+        ttf_font_datas[n].key = key;
+        ttf_font_datas[n].size = size;
+        hash_insert(key, n);
+
+        s->count++;
+        lru_push_front(s, n);
+    }
+    else if(n != s->lru_head) {
+        lru_unlink(s, n);
+        lru_push_front(s, n);
+    }
+
+    return n;
 }
 
 static void DrawBox_ttf(float x, float y, float z, float w, float h, u32 rgba)
@@ -282,30 +581,58 @@ static void DrawBox_ttf(float x, float y, float z, float w, float h, u32 rgba)
     tiny3d_End();
 }
 
-static void DrawTextBox_ttf(float x, float y, float z, float w, float h, u32 rgba, float tx, float ty)
+static void AddTextBox_ttf(float x, float y, float w, float h, int slot)
 {
+    ttf_quads[quad_count].x = x;
+    ttf_quads[quad_count].y = y;
+    ttf_quads[quad_count].w = w;
+    ttf_quads[quad_count].h = h;
+
+    // only the glyph bitmap, the rest of the cell is left empty
+    ttf_quads[quad_count].u = (float) ((slot % TTF_ATLAS_CELLS) * TTF_CELL) / TTF_ATLAS_SIZE;
+    ttf_quads[quad_count].v = (float) ((slot / TTF_ATLAS_CELLS) * TTF_CELL) / TTF_ATLAS_SIZE;
+    ttf_quads[quad_count].tw = (float) ttf_font_datas[slot].width / TTF_ATLAS_SIZE;
+    ttf_quads[quad_count].th = (float) ttf_font_datas[slot].height / TTF_ATLAS_SIZE;
+    quad_count++;
+}
+
+// draws the queued glyphs with one texture bind and one polygon list
+static void FlushTextBoxes_ttf(float z, float w, float h, u32 rgba, u32 bkcolor)
+{
+    int n;
+
+    if(!quad_count) return;
+
+    if(bkcolor != 0) {
+        for(n = 0; n < quad_count; n++) DrawBox_ttf(ttf_quads[n].x, ttf_quads[n].y, z, w, h, bkcolor);
+    }
+
+    tiny3d_SetTextureWrap(0, ttf_atlas_offset, TTF_ATLAS_SIZE, TTF_ATLAS_SIZE, TTF_ATLAS_SIZE * 2,
+        TINY3D_TEX_FORMAT_A4R4G4B4, TEXTWRAP_CLAMP, TEXTWRAP_CLAMP, TEXTURE_LINEAR);
+
     tiny3d_SetPolygon(TINY3D_QUADS);
-    
-   
-    tiny3d_VertexPos(x    , y    , z);
-    tiny3d_VertexColor(rgba);
-    tiny3d_VertexTexture(0.0f , 0.0f);
 
-    tiny3d_VertexPos(x + w, y    , z);
-    tiny3d_VertexTexture(tx, 0.0f);
+    for(n = 0; n < quad_count; n++) {
+        ttf_quad *q = &ttf_quads[n];
 
-    tiny3d_VertexPos(x + w, y + h, z);
-    tiny3d_VertexTexture(tx, ty);
+        tiny3d_VertexPos(q->x       , q->y       , z);
+        tiny3d_VertexColor(rgba);
+        tiny3d_VertexTexture(q->u        , q->v        );
 
-    tiny3d_VertexPos(x    , y + h, z);
-    tiny3d_VertexTexture(0.0f , ty);
+        tiny3d_VertexPos(q->x + q->w, q->y       , z);
+        tiny3d_VertexTexture(q->u + q->tw, q->v        );
 
-    tiny3d_End();
-}
+        tiny3d_VertexPos(q->x + q->w, q->y + q->h, z);
+        tiny3d_VertexTexture(q->u + q->tw, q->v + q->th);
 
+        tiny3d_VertexPos(q->x       , q->y + q->h, z);
+        tiny3d_VertexTexture(q->u        , q->v + q->th);
+    }
 
-#define TTF_UX 30
-#define TTF_UY 24
+    tiny3d_End();
+
+    quad_count = 0;
+}
 
 
 int display_ttf_string(int posx, int posy, const char *string, u32 color, u32 bkcolor, int sw, int sh)
@@ -317,6 +644,9 @@ int display_ttf_string(int posx, int posy, const char *string, u32 color, u32 bk
 
     int lenx = 0;
 
+    int size = find_ttf_size(sw, sh);
+    ttf_size *tsize = &ttf_sizes[size];
+
     while(*ustring) {
 
         if(posy >= Win_H_ttf) break;
@@ -361,29 +691,7 @@ int display_ttf_string(int posx, int posy, const char *string, u32 color, u32 bk
 
         if(ttf_char < 32) ttf_char='?';
 
-        // search ttf_char
-        if(ttf_char < 128) n= ttf_char;
-        else {
-            m= 0;
-            int rel=0;
-            
-            for(n= 128; n < MAX_CHARS; n++) {
-                if(!(ttf_font_datas[n].flags & 1)) m= n;
-                
-                if((ttf_font_datas[n].flags & 3)==1) {
-                    int trel= r_use - ttf_font_datas[n].r_use;
-                    if(m==0) {m= n;rel = trel;}
-                    else if(rel > trel) {m= n;rel = trel;}
-
-                }
-                if(ttf_font_datas[n].ttf == ttf_char) break;
-            }
-
-            if(m==0) m = 128;
-
-        }
-
-        if(n >= MAX_CHARS) {ttf_font_datas[m].flags = 0; l= m;} else l=n;
+        l = find_ttf_slot(ttf_char, size);
 
         u16 * bitmap = ttf_font_datas[l].text;
         
@@ -391,54 +699,39 @@ int display_ttf_string(int posx, int posy, const char *string, u32 color, u32 bk
 
         if(!(ttf_font_datas[l].flags & 1)) { 
 
-            if(f_face[0]) FT_Set_Pixel_Sizes(face[0], TTF_UX, TTF_UY);
-            if(f_face[1]) FT_Set_Pixel_Sizes(face[1], TTF_UX, TTF_UY);
-            if(f_face[2]) FT_Set_Pixel_Sizes(face[2], TTF_UX, TTF_UY);
-            if(f_face[3]) FT_Set_Pixel_Sizes(face[3], TTF_UX, TTF_UY);
-
-            FT_GlyphSlot slot = NULL;
-
-            memset(bitmap, 0, 32 * 32 * 2);
+            for(n = 0; n < TTF_CELL; n++) memset(bitmap + n * TTF_ATLAS_SIZE, 0, TTF_CELL * 2);
 
-            ///////////
+            FT_GlyphSlot slot = render_glyph(ttf_char, tsize->rw, tsize->rh);
 
-            FT_UInt index;
+            // characters missing from the fonts are kept as empty glyphs, they are not looked up again
+            ttf_font_datas[l].flags = 1;
+            ttf_font_datas[l].y_start = 0;
+            ttf_font_datas[l].height = 0;
+            ttf_font_datas[l].width = 0;
 
-            if(f_face[0] && (index = FT_Get_Char_Index(face[0], ttf_char))!=0 
-                && !FT_Load_Glyph(face[0], index, FT_LOAD_RENDER )) slot = face[0]->glyph;
-            else if(f_face[1] && (index = FT_Get_Char_Index(face[1], ttf_char))!=0 
-                && !FT_Load_Glyph(face[1], index, FT_LOAD_RENDER )) slot = face[1]->glyph;
-            else if(f_face[2] && (index = FT_Get_Char_Index(face[2], ttf_char))!=0 
-                && !FT_Load_Glyph(face[2], index, FT_LOAD_RENDER )) slot = face[2]->glyph;
-            else if(f_face[3] && (index = FT_Get_Char_Index(face[3], ttf_char))!=0 
-                && !FT_Load_Glyph(face[3], index, FT_LOAD_RENDER )) slot = face[3]->glyph;
-            else ttf_char = 0;
-
-            if(ttf_char!=0) {
+            if(slot) {
                 ww = ww2 = 0;
 
-                int y_correction = TTF_UY - 1 - slot->bitmap_top;
+                int y_correction = tsize->rh - 1 - slot->bitmap_top;
                 if(y_correction < 0) y_correction = 0;
 
-                ttf_font_datas[l].flags = 1;
                 ttf_font_datas[l].y_start = y_correction;
                 ttf_font_datas[l].height = slot->bitmap.rows;
                 ttf_font_datas[l].width = slot->bitmap.width;
-                ttf_font_datas[l].ttf = ttf_char;
                 
 
                 for(n = 0; n < slot->bitmap.rows; n++) {
-                    if(n >= 32) break;
+                    if(n >= TTF_CELL) break;
                     for (m = 0; m < slot->bitmap.width; m++) {
 
-                        if(m >= 32) continue;
+                        if(m >= TTF_CELL) continue;
                         
                         colorc = (u8) slot->bitmap.buffer[ww + m];
                         
                         if(colorc) bitmap[m + ww2] = (colorc<<8) | 0xfff;
                     }
                 
-                ww2 += 32;
+                ww2 += TTF_ATLAS_SIZE;
 
                 ww += slot->bitmap.width;
                 }
@@ -447,36 +740,60 @@ int display_ttf_string(int posx, int posy, const char *string, u32 color, u32 bk
         }
 
         // displaying the character
-        ttf_font_datas[l].flags |= 2; // in use
-        ttf_font_datas[l].r_use = r_use;
+        float gw = ttf_font_datas[l].width * tsize->sx;
+        u32 cx = (u32) gw + 1;
 
-        if((Win_flag & WIN_AUTO_LF) && (posx + (ttf_font_datas[l].width * sw / 32) + 1) > Win_W_ttf) {
+        if((Win_flag & WIN_AUTO_LF) && (posx + cx) > Win_W_ttf) {
             posx = 0;
             posy += sh;
         }
 
         u32 ccolor = color;
-        u32 cx =(ttf_font_datas[l].width * sw / 32) + 1;
 
         // skip if out of window
         if((posx + cx) > Win_W_ttf || (posy + sh) > Win_H_ttf ) ccolor = 0;
 
-        if(ccolor) {
-            tiny3d_SetTextureWrap(0, tiny3d_TextureOffset(bitmap), 32, 32, 32 * 2,
-                TINY3D_TEX_FORMAT_A4R4G4B4, TEXTWRAP_CLAMP, TEXTWRAP_CLAMP, TEXTURE_LINEAR);
+        if(ccolor && ttf_font_datas[l].width) {
+            if(quad_count == TTF_MAX_QUADS) FlushTextBoxes_ttf(Z_ttf, (float) sw, (float) sh, color, bkcolor);
 
-            if (bkcolor != 0) DrawBox_ttf((float) (Win_X_ttf + posx), (float) (Win_Y_ttf + posy) + ((float) ttf_font_datas[l].y_start * sh) * 0.03125f,
-            Z_ttf, (float) sw, (float) sh, bkcolor);
-            DrawTextBox_ttf((float) (Win_X_ttf + posx), (float) (Win_Y_ttf + posy) + ((float) ttf_font_datas[l].y_start * sh) * 0.03125f,
-            Z_ttf, (float) sw, (float) sh, color,
-            0.99f, 0.99f);
+            AddTextBox_ttf((float) (Win_X_ttf + posx), (float) (Win_Y_ttf + posy) + ttf_font_datas[l].y_start * tsize->sy,
+                gw, ttf_font_datas[l].height * tsize->sy, l);
         }
 
         posx+= cx;
     }
 
+    FlushTextBoxes_ttf(Z_ttf, (float) sw, (float) sh, color, bkcolor);
+
     Y_ttf = (float) posy + sh;
 
     if(posx < lenx) posx = lenx;
     return posx;
 }
+
+int width_ttf_string(const char *string, int sw, int sh)
+{
+    u32 hash = 2166136261u;
+    u32 len = 0;
+
+    // FNV-1a
+    while(string[len]) {
+        hash = (hash ^ (u8) string[len]) * 16777619u;
+        len++;
+    }
+
+    ttf_width *w = &ttf_widths[hash & (TTF_WIDTH_CACHE - 1)];
+
+    if(w->len != len || w->hash != hash || w->sw != sw || w->sh != sh || w->mode != Win_flag || w->win_w != Win_W_ttf || w->win_h != Win_H_ttf) {
+        w->hash = hash;
+        w->len = len;
+        w->sw = sw;
+        w->sh = sh;
+        w->mode = Win_flag;
+        w->win_w = Win_W_ttf;
+        w->win_h = Win_H_ttf;
+        w->width = display_ttf_string(0, 0, string, 0, 0, sw, sh);
+    }
+
+    return w->width;
+}